@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <time.h>
 #include <sys/select.h>
@@ -50,6 +51,7 @@ typedef struct core
 	timer_t timer_id;
 
 	volatile uint32_t intr_pending;
+	volatile int intr_enabled;	/* The (virtual) interrupt-enable flag */
 	interrupt_handler* intvec[maximum_interrupt_no];
 
 
@@ -123,7 +125,7 @@ static void initialize()
 	physical_cores = get_nprocs();
 
 	USR1_sigaction.sa_sigaction = sigusr1_handler;
-	USR1_sigaction.sa_flags = SA_SIGINFO;
+	USR1_sigaction.sa_flags = SA_SIGINFO | SA_NODEFER;
 	sigemptyset(& USR1_sigaction.sa_mask);
 
 	/* Create the sigmask to block all signals, except USR1 */
@@ -180,6 +182,7 @@ static void* core_thread(void* _core)
 
 	/* Clear pending bitvec */
 	core->intr_pending = 0;
+	core->intr_enabled = 1;
 
 	/* Default interrupt handlers */
 	for(int i=0; i<maximum_interrupt_no; i++) 
@@ -292,7 +295,11 @@ static inline void interrupt_core(Core* core)
 	Raise an interrupt to a core.
 
 	Adds intno as pending for the core and causes a signal to
-	be delivered.
+	be delivered, unless the core has interrupts disabled (and
+	is not halted). In that case, the pending interrupt is 
+	dispatched when the core enables interrupts; see 
+	cpu_enable_interrupts(), which checks intr_pending after
+	setting intr_enabled, as we do in reverse order here.
  */
 static inline void raise_interrupt(Core* core, Interrupt intno) 
 {
@@ -302,7 +309,9 @@ static inline void raise_interrupt(Core* core, Interrupt intno)
 		core->irq_raised[intno] ++;
 #endif
 
-		interrupt_core(core);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if(core->intr_enabled || (halt_vector & (1u << core->id)))
+			interrupt_core(core);
 	}
 }
 
@@ -342,8 +351,37 @@ static inline void dispatch_interrupts(Core* core)
 }
 
 
+/*
+	Dispatch the pending interrupts of the current core, as if they
+	interrupted the current code. The handlers run with interrupts 
+	disabled, and interrupts are enabled again at the end. 
+	
+	Note that a handler may switch contexts, so that we may resume
+	on a different core.
+ */
+static void run_pending_interrupts()
+{
+	Core* core = curr_core();
+	while(core->intr_pending) {
+		core->intr_enabled = 0;
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+		dispatch_interrupts(core);
+
+		core = curr_core();
+		__atomic_store_n(& core->intr_enabled, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+
 /*
 	This is the signal handler for core threads, to handle interrupts.
+
+	The handler is installed with SA_NODEFER, so that SIGUSR1 stays 
+	unblocked if a handler switches contexts. Instead, interrupts
+	are masked by the intr_enabled flag of the core. A signal that 
+	arrives while interrupts are disabled is ignored; its interrupt
+	remains pending, to be dispatched by cpu_enable_interrupts().
  */
 static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 {
@@ -353,7 +391,8 @@ static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 	core->irq_count++;
 #endif
 
-	dispatch_interrupts(core);
+	if(core->intr_enabled)
+		run_pending_interrupts();
 }
 
 
@@ -992,6 +1031,17 @@ uint cpu_cores()
 	return ncores;
 }
 
+uint cpu_parallel_cores()
+{
+	return (ncores < physical_cores) ? ncores : physical_cores;
+}
+
+void cpu_relax()
+{
+	if(ncores > physical_cores)
+		sched_yield();
+}
+
 
 
 void cpu_core_halt()
@@ -1005,26 +1055,23 @@ void cpu_core_halt()
 	TimerDuration stime0 = get_coarse_time();
 #endif
 
-	/* Set halt bit */
-	__atomic_fetch_or(& halt_vector, cmask, __ATOMIC_RELAXED);
+	/* Set halt bit; from now on, raise_interrupt() will signal us */
+	__atomic_fetch_or(& halt_vector, cmask, __ATOMIC_SEQ_CST);
 
 #if defined(CORE_STATISTICS)
 	core->hlt_count ++;
 #endif
 
-	siginfo_t info;
-
-	/* Sleep for 10 msec */
-	//struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
-	//int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
-	int rc = sigwaitinfo(&sigusr1_set, &info);
+	/* Do not sleep if an interrupt was raised (unsignalled) before */
+	if(core->intr_pending == 0) {
+		siginfo_t info;
 
-	if(rc>0) {
-		/* Got signal, dispatch */
-		dispatch_interrupts(core);
-	}
-	else {
-		assert(rc==-1 &&  (errno == EINTR || errno == EAGAIN));
+		/* Sleep for 10 msec */
+		//struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
+		//int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
+		int rc = sigwaitinfo(&sigusr1_set, &info);
+		assert(rc>0 || (rc==-1 &&  (errno == EINTR || errno == EAGAIN)));
+		(void) rc;
 	}
 
 #if defined(CORE_STATISTICS)
@@ -1035,6 +1082,10 @@ void cpu_core_halt()
 	__atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
 
 	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+
+	/* Dispatch the interrupts that woke us up */
+	if(core->intr_enabled)
+		run_pending_interrupts();
 }
 
 static int __core_restart(uint c)
@@ -1054,9 +1105,9 @@ static int __core_restart(uint c)
 }
 
 
-void cpu_core_restart(uint c)
+int cpu_core_restart(uint c)
 {
-	__core_restart(c);
+	return __core_restart(c);
 }
 
 
@@ -1092,32 +1143,44 @@ void cpu_ici(uint core)
 
 void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler)
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, &curss));
+	int enabled = cpu_disable_interrupts();
 	curr_core()->intvec[interrupt] = handler;
-	CHECKRC(pthread_sigmask(SIG_SETMASK, &curss, NULL));
+	if(enabled) cpu_enable_interrupts();
 }
 
+/*
+	Interrupts are masked in software, by the intr_enabled flag of the
+	core, so that these are plain memory operations. The signal fences
+	keep the compiler from moving memory accesses across them; the 
+	signal handler runs on the same thread.
+ */
 int cpu_interrupts_enabled()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, NULL, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	return curr_core()->intr_enabled;
 }
 
 int cpu_disable_interrupts()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	Core* core = curr_core();
+	int enabled = core->intr_enabled;
+	core->intr_enabled = 0;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	return enabled;
 }
 
 void cpu_enable_interrupts()
 {
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	Core* core = curr_core();
+	__atomic_store_n(& core->intr_enabled, 1, __ATOMIC_SEQ_CST);
+
+	/* Dispatch the interrupts raised while we were disabled */
+	if(core->intr_pending)
+		run_pending_interrupts();
 }
 
 
+#if defined(BIOS_UCONTEXT)
+
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
   /* Init the context from this context! */
@@ -1129,8 +1192,8 @@ void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, voi
   ctx->uc_stack.ss_size = ss_size;
   ctx->uc_stack.ss_flags = 0;
 
-  //CHECKRC(pthread_sigmask(0, NULL, & ctx->uc_sigmask));  /* We don't want any signals changed */
-  sigfillset( & ctx->uc_sigmask );
+  /* Interrupts are masked in software; SIGUSR1 must stay unblocked */
+  ctx->uc_sigmask = core_signal_set;
   makecontext(ctx, (void*) ctx_func, 0);
 }
 
@@ -1140,6 +1203,94 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 	swapcontext(oldctx, newctx);
 }
 
+#else
+
+/*
+	The x86-64 context switch.
+
+	void __cpu_switch(void** oldsp, void* newsp)
+
+	The callee-saved registers of the SysV ABI, and the MXCSR and x87 control
+	words, are pushed on the current stack, whose pointer is stored in *oldsp.
+	Then, the same are popped from newsp, and we return into the new context.
+	
+	A new context starts at __cpu_context_start, which calls the context 
+	function (placed in r12 by cpu_initialize_context) on an aligned stack.
+ */
+void __cpu_switch(void** oldsp, void* newsp);
+void __cpu_context_start();
+
+__asm__(
+	".text\n"
+	".p2align 4\n"
+	".type __cpu_switch, @function\n"
+	"__cpu_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size __cpu_switch, .-__cpu_switch\n"
+	"\n"
+	".p2align 4\n"
+	".type __cpu_context_start, @function\n"
+	"__cpu_context_start:\n"
+	"	callq *%r12\n"
+	"	ud2\n"
+	".size __cpu_context_start, .-__cpu_context_start\n"
+);
+
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	/* 
+		The initial frame, as popped by __cpu_switch. Returning to 
+		__cpu_context_start leaves the stack 16-byte aligned for the call.
+	 */
+	uintptr_t top = ((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15;
+	uint64_t* frame = (uint64_t*)(top - 8*sizeof(uint64_t));
+
+	uint32_t mxcsr;
+	uint16_t fpucw;
+	__asm__ volatile("stmxcsr %0" : "=m"(mxcsr));
+	__asm__ volatile("fnstcw %0" : "=m"(fpucw));
+
+	frame[0] = mxcsr | ((uint64_t)fpucw << 32);
+	frame[1] = 0;                            /* r15 */
+	frame[2] = 0;                            /* r14 */
+	frame[3] = 0;                            /* r13 */
+	frame[4] = (uintptr_t) ctx_func;         /* r12 */
+	frame[5] = 0;                            /* rbx */
+	frame[6] = 0;                            /* rbp */
+	frame[7] = (uintptr_t) __cpu_context_start;  /* return address */
+
+	ctx->sp = frame;
+}
+
+
+void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
+{
+	__cpu_switch(&oldctx->sp, newctx->sp);
+}
+
+#endif
+
 
 
 /*
@@ -1176,6 +1327,13 @@ TimerDuration bios_clock()
 	return get_coarse_time();
 }	
 
+TimerDuration bios_clock_precise()
+{
+	struct timespec curtime;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &curtime));
+	return curtime.tv_nsec / 1000ul + curtime.tv_sec*1000000ull;
+}
+
 
 
 uint bios_serial_ports()
@@ -2,7 +2,20 @@
 #define BIOS_H
 
 #include <stdint.h>
+#include <stddef.h>
+
+/*
+	On x86-64, contexts are switched by a few lines of assembly, which save
+	only the callee-saved registers. Define BIOS_UCONTEXT (or build with 
+	'make UCONTEXT=1') to use the ucontext(3) functions instead.
+ */
+#if !defined(__x86_64__) && !defined(BIOS_UCONTEXT)
+#define BIOS_UCONTEXT
+#endif
+
+#if defined(BIOS_UCONTEXT)
 #include <ucontext.h>
+#endif
 
 /**
 	@file bios.h
@@ -302,6 +315,27 @@ extern _Thread_local uint cpu_core_id;
  */
 uint cpu_cores();
 
+/**
+   	@brief Returns the number of cores that can actually run in parallel.
+
+   	This is the number of cores, limited by the number of processors of 
+   	the host machine. Cores beyond this number time-share the host 
+   	processors, so restarting one of them, in order to run a thread in 
+   	parallel, does not pay off.
+ */
+uint cpu_parallel_cores();
+
+/**
+	@brief Let other cores use the host processor.
+
+	A core that spins, waiting for another core, should call this from time
+	to time. When the cores time-share the host processors (see 
+	@c cpu_parallel_cores), the core waited for may not be running; this 
+	call gives it a chance to run, much like a pause-loop exit of a 
+	virtualized processor. Otherwise, this call does nothing.
+ */
+void cpu_relax();
+
 
 /**
 	@brief Barrier synchronization for all cores.
@@ -344,7 +378,9 @@ void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler);
 	If an interrupt arrives while interrupts are disabled, it will be
 	marked as _pending_ and will be raised when interrupts are re-enabled.
 
-	
+	Interrupts are masked in software, by a flag of the core, so that this
+	call (and @c cpu_enable_interrupts) does not make a system call.
+
 
 	@returns 1 if interrupts were enabled before the call, else 0.
 	@see cpu_enable_interrupts
@@ -387,8 +423,9 @@ void cpu_core_halt();
 
 	This call will restart the given core, if it was halted.
 	@param c the core to restart
+	@returns 1 if the core was halted and has been restarted, else 0
 */
-void cpu_core_restart(uint c);
+int cpu_core_restart(uint c);
 
 /**
 	@brief Restart some halted core.
@@ -407,8 +444,18 @@ void cpu_core_restart_all();
 
 /**
 	@brief A type for saving CPU context into.
+
+	Unless @c BIOS_UCONTEXT is defined, this is just the saved stack pointer
+	of a suspended context; the callee-saved registers (and the SSE and x87
+	control words) are kept on its stack. The signal mask is not part of the
+	context; contexts must be switched with the same signal mask, e.g., with
+	interrupts disabled.
 */
+#if defined(BIOS_UCONTEXT)
 typedef ucontext_t cpu_context_t;
+#else
+typedef struct { void* sp; } cpu_context_t;
+#endif
 
 
 /**
@@ -419,7 +466,7 @@ typedef ucontext_t cpu_context_t;
 	@param ctx the context object to initialize
 	@param ss_sp the pointer to the beginning of the stack segment
 	@param ss_size the size of the stack segment
-	@param func the function to execute in the new context
+	@param func the function to execute in the new context; it must not return
 */
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*func)());
 
@@ -483,6 +530,16 @@ TimerDuration bios_cancel_timer();
  */
 TimerDuration bios_clock();
 
+/**
+	@brief Get the current time from a precise, monotonic clock.
+
+	This function returns the value of a monotonic clock, in usec. 
+	Unlike @c bios_clock(), its resolution is fine enough to measure 
+	short intervals, such as a thread's time-slice. The origin of the 
+	clock is unspecified.
+ */
+TimerDuration bios_clock_precise();
+
 
 
 
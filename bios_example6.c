@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bios.h"
+
+/*
+	A microbenchmark for cpu_swap_context.
+
+	Each core switches back and forth between its boot context and a 
+	second context, and reports the number of switches per second.
+	Build with 'make switch_bench' to compare with the ucontext(3) 
+	implementation (BIOS_UCONTEXT).
+ */
+
+#define SWITCHES 2000000
+#define STACK_SIZE (64*1024)
+
+static _Thread_local cpu_context_t main_ctx, peer_ctx;
+
+static void peer()
+{
+	while(1)
+		cpu_swap_context(&peer_ctx, &main_ctx);
+}
+
+void bootfunc()
+{
+	void* stack = malloc(STACK_SIZE);
+	cpu_initialize_context(&peer_ctx, stack, STACK_SIZE, peer);
+
+	/* The signal mask must be the same in both contexts */
+	cpu_disable_interrupts();
+
+	TimerDuration t0 = bios_clock_precise();
+	for(int i=0; i<SWITCHES/2; i++)
+		cpu_swap_context(&main_ctx, &peer_ctx);
+	TimerDuration t = bios_clock_precise() - t0;
+
+	cpu_enable_interrupts();
+
+	fprintf(stderr, "core %u: %d switches in %lu usec, %.0f switches/sec\n", 
+		cpu_core_id, SWITCHES, (unsigned long) t, SWITCHES*1E6/t);
+	free(stack);
+}
+
+int main()
+{
+#if defined(BIOS_UCONTEXT)
+	fprintf(stderr, "cpu_swap_context: ucontext\n");
+#else
+	fprintf(stderr, "cpu_swap_context: x86-64 assembly\n");
+#endif
+	vm_boot(bootfunc, 1, 0);
+	return 0;
+}
@@ -61,6 +61,77 @@ void Mutex_Unlock(Mutex* lock)
 }
 
 
+/*
+  Ticket spinlock.
+  ----------------
+
+  A locker takes a ticket by incrementing lock->next, and spins until
+  lock->owner reaches its ticket; unlocking increments lock->owner. 
+  Tickets wrap around at 2^16, which is fine as long as there are fewer
+  than 2^16 waiters.
+
+  A waiter pauses in proportion to its distance from the head of the 
+  queue, so that the waiters far back poll the lock less often.
+ */
+static inline void spin_pause(unsigned int n)
+{
+  while(n--) {
+#if defined(__x86__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#endif
+  }
+}
+
+/* The spins without progress before cpu_relax() */
+#define SPINLOCK_SPINS 1000
+#define SPINLOCK_RELAX_SPINS 16
+
+void Spinlock_Lock(Spinlock* lock)
+{
+  /* A waiter is never preempted while it holds a ticket */
+  assert(! cpu_interrupts_enabled());
+
+  /* 
+    Wait for our ticket. The lock is handed to the waiters in order, so if
+    the next waiter is not running, nobody else can take the lock; hence
+    the cpu_relax() when the queue does not move for a while; sooner when
+    the cores time-share the host CPUs.
+   */
+  unsigned short ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+  unsigned short owner, last = ticket;
+  const int relax_spins = (cpu_parallel_cores() < cpu_cores()) ? SPINLOCK_RELAX_SPINS : SPINLOCK_SPINS;
+  int spin = relax_spins;
+  while((owner = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE)) != ticket) {
+    spin_pause((unsigned short)(ticket - owner));
+    if(owner != last) {
+      last = owner;
+      spin = relax_spins;
+    }
+    else if(--spin == 0) {
+      spin = relax_spins;
+      cpu_relax();
+    }
+  }
+}
+
+
+int Spinlock_TryLock(Spinlock* lock)
+{
+  /* The lock is free iff next == owner; owner cannot move while it is */
+  unsigned short owner = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+  unsigned short next = owner;
+  return __atomic_compare_exchange_n(&lock->next, &next, (unsigned short)(owner+1), 0,
+    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+
+void Spinlock_Unlock(Spinlock* lock)
+{
+  /* Only the holder writes owner */
+  __atomic_store_n(&lock->owner, (unsigned short)(lock->owner+1), __ATOMIC_RELEASE);
+}
+
+
 /*
 	Condition variables.	
 */
@@ -194,10 +265,68 @@ void Cond_Signal(CondVar* cv)
 }
 
 
+/**
+  @internal
+  Helper for Cond_SignalHandoff and kernel_broadcast_handoff. Wake up 
+  the first waiter (or all of them), and hand the core to the first one
+  that can be kept.
+ */
+static void cv_signal_handoff(CondVar* cv, int all)
+{
+  int preempt = preempt_off;
+  TCB* kept = NULL;
+
+  Mutex_Lock(&(cv->waitset_lock));
+  while(cv->waitset) {
+    __cv_waiter* waiter = cv->waitset;
+    remove_from_ring(cv, waiter);
+    waiter->removed = 1;
+    int rc = (kept == NULL) ? wakeup_handoff(waiter->thread) : wakeup(waiter->thread);
+    if(rc) {
+      waiter->signalled = 1;
+      if(rc == 2) kept = waiter->thread;
+      if(! all) break;
+    }
+  }
+  Mutex_Unlock(&(cv->waitset_lock));
+
+  /* The kept thread cannot run anywhere else, so it is still there */
+  if(kept != NULL)
+    handoff(kept);
+
+  if(preempt)
+    preempt_on;
+}
+
+void Cond_SignalHandoff(CondVar* cv)
+{
+  cv_signal_handoff(cv, 0);
+}
+
+
+/* The max. number of waiters woken up together by Cond_Broadcast */
+#define CV_WAKEUP_BATCH 32
+
 void Cond_Broadcast(CondVar* cv)
 {
   Mutex_Lock(&(cv->waitset_lock));
-  while(cv->waitset) cv_signal(cv);
+  while(cv->waitset) {
+    /* Take a batch of waiters out of the ring and wake them up together */
+    __cv_waiter* waiter[CV_WAKEUP_BATCH];
+    TCB* tcb[CV_WAKEUP_BATCH];
+    int n = 0;
+    while(cv->waitset && n < CV_WAKEUP_BATCH) {
+      waiter[n] = cv->waitset;
+      remove_from_ring(cv, waiter[n]);
+      waiter[n]->removed = 1;
+      tcb[n] = waiter[n]->thread;
+      n++;
+    }
+
+    wakeup_many(tcb, n);
+    for(int i=0; i<n; i++)
+      waiter[i]->signalled = (tcb[i] != NULL);
+  }
   Mutex_Unlock(&(cv->waitset_lock));
 }
 
@@ -211,61 +340,30 @@ void Cond_Broadcast(CondVar* cv)
  *
  */
 
-/**
- * @brief The kernel lock.
- *
- * Kernel locking is provided by a semaphore, implemented as a monitor.
- * A semaphre for kernel locking has advantages over a simple mutex. 
- * The main advantage is that @c kernel_mutex is held for a very short time
- * regardless of contention. Thus, in multicore machines, it allows for cores
- * to be passed to other threads. 
- * 
+/*
+  There is no global kernel lock. Each kernel object is protected by its
+  own Mutex, which is held only while the object is examined or changed:
+
+  - proc_lock (kernel_proc.c) protects the process table, the process tree
+    and the exited lists of the processes.
+  - PCB.lock protects the file table and the threads of a process.
+  - fcb_lock (kernel_streams.c) protects the FCB free list. The refcount of
+    an FCB is atomic.
+  - port_map_lock (kernel_socket.c) protects PORT_MAP and the connection
+    queues of the listener sockets.
+  - PIPE_CB.lock protects a pipe, including the pipes of peer sockets.
+
+  When more than one is held, they are taken in the order they are listed.
+  A stream is never closed while holding a PCB.lock, since its Close
+  method may need port_map_lock. The rest of the kernel locks (e.g., the
+  PTCB pool or a serial device) are leaves: no other lock is taken while
+  holding them.
  */
 
-/* This mutex is used to implement the kernel semaphore as a monitor. */
-static Mutex kernel_mutex = MUTEX_INIT;
-
-/* Semaphore counter */
-static int kernel_sem = 1;
-
-/* Semaphore condition */
-static CondVar kernel_sem_cv = COND_INIT;
-
-void kernel_lock()
-{
-	Mutex_Lock(& kernel_mutex);
-	while(kernel_sem<=0) {
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	}
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);
-}
-
-void kernel_unlock()
-{
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	Mutex_Unlock(& kernel_mutex);
-}
-
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan_name, TimerDuration timeout)
 {
-	/* Atomically release kernel semaphore */
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);	
-
-	int ret = cv_wait(&kernel_mutex, cv, cause, timeout);
-
-	/* Reacquire kernel semaphore */
-	while(kernel_sem<=0)
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);		
-
-	return ret;
+	return cv_wait(mx, cv, cause, timeout);
 }
 
 void kernel_signal(CondVar* cv) 
@@ -278,14 +376,12 @@ void kernel_broadcast(CondVar* cv)
 	Cond_Broadcast(cv); 
 }
 
+void kernel_broadcast_handoff(CondVar* cv) 
+{ 
+	cv_signal_handoff(cv, 1); 
+}
+
 void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
 {
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	sleep_releasing(newstate, &kernel_mutex, cause, NO_TIMEOUT);
+	sleep_releasing(newstate, NULL, cause, NO_TIMEOUT);
 }
-
-
-
-
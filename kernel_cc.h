@@ -33,36 +33,32 @@
 
 
 /*
- * Kernel preemption control.
- * These are wrappers for the kernel monitor.
+ * Kernel waits.
+ * These are wrappers for the condition variables, used by the
+ * kernel objects with their own locks.
  */
 
 /**
-	@brief Lock the kernel.
- */
-void kernel_lock();
+	@brief Wait on a condition variable, releasing the lock of a kernel object.
 
-/**
-	@brief Unlock the kernel.
- */
-void kernel_unlock();
+	The mutex @c mx must be held; it is released while waiting, and it
+	is held again on return.
 
-/**
-	@brief Wait on a condition variable using the kernel lock.
 	@returns 1 if signalled, 0 if not
   */
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan, TimerDuration timeout);
 
-#define kernel_wait(cv, cause) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, NO_TIMEOUT)
-#define kernel_timedwait(cv, cause, timeout) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, (timeout))
+#define kernel_wait(mx, cv, cause) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, NO_TIMEOUT)
+#define kernel_timedwait(mx, cv, cause, timeout) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, (timeout))
 
 /**
 	@brief Signal a kernel condition to one waiter.
 
-	This call must be made 
+	To avoid a lost wakeup, this call must be made 
+	while holding the mutex that the waiters release.
   */
 void kernel_signal(CondVar* cv);
 
@@ -71,12 +67,24 @@ void kernel_signal(CondVar* cv);
   */
 void kernel_broadcast(CondVar* cv);
 
+/**
+	@brief Signal a kernel condition to all waiters, and hand the core 
+	to one of them.
+
+	This is for a thread that has just produced what a waiter will
+	consume (e.g., the data of a pipe): the current core switches to one
+	of the woken threads at once, as by @c Cond_SignalHandoff.
+	The call must be made after releasing the mutex that the waiters 
+	release, else the woken thread would block on it. This is safe, since
+	a waiter joins the wait set before releasing the mutex.
+  */
+void kernel_broadcast_handoff(CondVar* cv);
+
 
 /**
-	@brief Put thread to sleep, unlocking the kernel.
+	@brief Put the current thread to sleep.
 
-	System calls should call this function instead of @c sleep_releasing,
-	as the kernel lock is not a mutex.
+	This is used by an exiting thread, after it has released all its locks.
   */
 void kernel_sleep(Thread_state state, enum SCHED_CAUSE cause);
 
@@ -65,6 +65,14 @@ void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
   boot_rec.argl = argl;
   boot_rec.args = args;
 
+  /* The scheduler policy may be chosen via the environment */
+  const char* policy = getenv("TINYOS_SCHED");
+  if(policy != NULL && sched_select_policy(policy) == -1)
+    FATAL("Unknown scheduler policy in TINYOS_SCHED");
+
+  /* Stack depth measurements may be enabled via the environment */
+  sched_set_stack_paint(getenv("TINYOS_STACKPAINT") != NULL);
+
   vm_boot(boot_tinyos_kernel, ncores, nterm);
 }
 
@@ -33,16 +33,15 @@ int sys_Pipe(pipe_t *pipe)
 
 	pipe_cb->reader = fcb[0];
 	pipe_cb->writer = fcb[1];
+	pipe_cb->lock = MUTEX_INIT;
 	pipe_cb->has_space = COND_INIT;
 	pipe_cb->has_data = COND_INIT;
 	pipe_cb->w_position = 0;
 	pipe_cb->r_position = 0;
 	pipe_cb->current_size = 0;
 
-	fcb[0]->streamobj = pipe_cb;
-	fcb[1]->streamobj = pipe_cb;
-	fcb[0]->streamfunc = &pipe_read_file_ops;
-	fcb[1]->streamfunc = &pipe_write_file_ops;
+	FCB_publish(fcb[0], pipe_cb, &pipe_read_file_ops);
+	FCB_publish(fcb[1], pipe_cb, &pipe_write_file_ops);
 
 	return 0;
 }
@@ -54,8 +53,11 @@ int pipe_write(void *pipecb_t, const char *buf, unsigned int size)
 	int *w_position = &pipe_cb->w_position;
 	int bytes_written = 0;
 
+	Mutex_Lock(&pipe_cb->lock);
+
 	if (pipe_cb->reader == NULL || pipe_cb->writer == NULL)
 	{
+		Mutex_Unlock(&pipe_cb->lock);
 		return -1;
 	}
 
@@ -64,11 +66,12 @@ int pipe_write(void *pipecb_t, const char *buf, unsigned int size)
 		while (pipe_cb->current_size == PIPE_BUFFER_SIZE && pipe_cb->reader != NULL)
 		{
 			kernel_broadcast(&pipe_cb->has_data);
-			kernel_wait(&pipe_cb->has_space, SCHED_PIPE);
+			kernel_wait(&pipe_cb->lock, &pipe_cb->has_space, SCHED_PIPE);
 		}
 
 		if (pipe_cb->reader == NULL || pipe_cb->writer == NULL)
 		{
+			Mutex_Unlock(&pipe_cb->lock);
 			return bytes_written;
 		}
 
@@ -99,7 +102,10 @@ int pipe_write(void *pipecb_t, const char *buf, unsigned int size)
 		*w_position = (*w_position + copy_size) % PIPE_BUFFER_SIZE;
 	}
 
-	kernel_broadcast(&pipe_cb->has_data);
+	Mutex_Unlock(&pipe_cb->lock);
+
+	/* Run the reader right away; the write end is open while we write */
+	kernel_broadcast_handoff(&pipe_cb->has_data);
 
 	return bytes_written;
 }
@@ -111,8 +117,11 @@ int pipe_read(void *pipecb_t, char *buf, unsigned int size)
 	int *r_position = &pipe_cb->r_position;
 	int bytes_read = 0;
 
+	Mutex_Lock(&pipe_cb->lock);
+
 	if (pipe_cb->reader == NULL)
 	{
+		Mutex_Unlock(&pipe_cb->lock);
 		return -1;
 	}
 
@@ -121,11 +130,12 @@ int pipe_read(void *pipecb_t, char *buf, unsigned int size)
 		while (pipe_cb->current_size == 0 && pipe_cb->writer != NULL)
 		{
 			kernel_broadcast(&pipe_cb->has_space);
-			kernel_wait(&pipe_cb->has_data, SCHED_PIPE);
+			kernel_wait(&pipe_cb->lock, &pipe_cb->has_data, SCHED_PIPE);
 		}
 
 		if (pipe_cb->current_size == 0 && pipe_cb->writer == NULL)
 		{
+			Mutex_Unlock(&pipe_cb->lock);
 			return bytes_read;
 		}
 
@@ -156,7 +166,10 @@ int pipe_read(void *pipecb_t, char *buf, unsigned int size)
 		*r_position = (*r_position + copy_size) % PIPE_BUFFER_SIZE;
 	}
 
-	kernel_broadcast(&pipe_cb->has_space);
+	Mutex_Unlock(&pipe_cb->lock);
+
+	/* Run the writer right away; the read end is open while we read */
+	kernel_broadcast_handoff(&pipe_cb->has_space);
 
 	return bytes_read;
 }
@@ -170,10 +183,14 @@ int pipe_writer_close(void *_pipecb)
 
 	PIPE_CB *pipe_cb = (PIPE_CB *)_pipecb;
 
+	Mutex_Lock(&pipe_cb->lock);
 	pipe_cb->writer = NULL;
 	kernel_broadcast(&pipe_cb->has_data);
+	int unused = (pipe_cb->reader == NULL);
+	Mutex_Unlock(&pipe_cb->lock);
 
-	if (pipe_cb->reader == NULL)
+	/* The reader end closed first, so nobody else can be using the pipe */
+	if (unused)
 	{
 		free(pipe_cb);
 	}
@@ -190,10 +207,14 @@ int pipe_reader_close(void *_pipecb)
 
 	PIPE_CB *pipe_cb = (PIPE_CB *)_pipecb;
 
+	Mutex_Lock(&pipe_cb->lock);
 	pipe_cb->reader = NULL;
 	kernel_broadcast(&pipe_cb->has_space);
+	int unused = (pipe_cb->writer == NULL);
+	Mutex_Unlock(&pipe_cb->lock);
 
-	if (pipe_cb->writer == NULL)
+	/* The writer end closed first, so nobody else can be using the pipe */
+	if (unused)
 	{
 		free(pipe_cb);
 	}
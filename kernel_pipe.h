@@ -11,6 +11,7 @@
 typedef struct pipe_control_block{
 	FCB* reader;
 	FCB* writer;
+	Mutex lock;
 
 	CondVar has_space;
 	CondVar has_data;
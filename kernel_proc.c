@@ -18,6 +18,8 @@
 PCB PT[MAX_PROC];
 unsigned int process_count;
 
+Mutex proc_lock = MUTEX_INIT;
+
 PCB *get_pcb(Pid_t pid)
 {
   return PT[pid].pstate == FREE ? NULL : &PT[pid];
@@ -32,6 +34,7 @@ Pid_t get_pid(PCB *pcb)
 static inline void initialize_PCB(PCB *pcb)
 {
   pcb->pstate = FREE;
+  pcb->lock = MUTEX_INIT;
   pcb->argl = 0;
   pcb->args = NULL;
 
@@ -46,6 +49,11 @@ static inline void initialize_PCB(PCB *pcb)
 
   rlnode_init(&pcb->ptcb_list, NULL);
   pcb->thread_count = 0;
+  pcb->ptcb_count = 0;
+
+  pcb->thread_table = NULL;
+  pcb->thread_table_size = 0;
+  pcb->thread_table_free = -1;
 }
 
 static PCB *pcb_freelist;
@@ -69,6 +77,7 @@ void initialize_processes()
   }
 
   process_count = 0;
+  stack_stats_reset();
 
   /* Execute a null "idle" process */
   if (Exec(NULL, 0, NULL) != 0)
@@ -76,7 +85,7 @@ void initialize_processes()
 }
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_lock held
 */
 PCB *acquire_PCB()
 {
@@ -94,7 +103,7 @@ PCB *acquire_PCB()
 }
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_lock held
 */
 void release_PCB(PCB *pcb)
 {
@@ -145,17 +154,37 @@ Pid_t sys_Exec(Task call, int argl, void *args)
 {
   PCB *curproc, *newproc;
 
+  /* Copy the arguments to new storage, owned by the new process */
+  void *newargs = NULL;
+  if (args != NULL)
+  {
+    newargs = malloc(argl);
+    memcpy(newargs, args, argl);
+  }
+
+  Mutex_Lock(&proc_lock);
+
   /* The new process PCB */
   newproc = acquire_PCB();
 
   if (newproc == NULL)
+  {
+    Mutex_Unlock(&proc_lock);
+    free(newargs);
     goto finish; /* We have run out of PIDs! */
+  }
+
+  /* Set the main thread's function */
+  newproc->main_task = call;
+  newproc->argl = argl;
+  newproc->args = newargs;
 
   if (get_pid(newproc) <= 1)
   {
     /* Processes with pid<=1 (the scheduler and the init process)
        are parentless and are treated specially. */
     newproc->parent = NULL;
+    Mutex_Unlock(&proc_lock);
   }
   else
   {
@@ -165,29 +194,22 @@ Pid_t sys_Exec(Task call, int argl, void *args)
     /* Add new process to the parent's child list */
     newproc->parent = curproc;
     rlist_push_front(&curproc->children_list, &newproc->children_node);
+    Mutex_Unlock(&proc_lock);
 
-    /* Inherit file streams from parent */
+    /* Inherit file streams from parent, except those still being opened */
+    Mutex_Lock(&curproc->lock);
     for (int i = 0; i < MAX_FILEID; i++)
     {
-      newproc->FIDT[i] = curproc->FIDT[i];
-      if (newproc->FIDT[i])
-        FCB_incref(newproc->FIDT[i]);
+      FCB *fcb = curproc->FIDT[i];
+      if (fcb != NULL && __atomic_load_n(&fcb->streamfunc, __ATOMIC_ACQUIRE) != NULL)
+      {
+        FCB_incref(fcb);
+        newproc->FIDT[i] = fcb;
+      }
     }
+    Mutex_Unlock(&curproc->lock);
   }
 
-  /* Set the main thread's function */
-  newproc->main_task = call;
-
-  /* Copy the arguments to new storage, owned by the new process */
-  newproc->argl = argl;
-  if (args != NULL)
-  {
-    newproc->args = malloc(argl);
-    memcpy(newproc->args, args, argl);
-  }
-  else
-    newproc->args = NULL;
-
   /*
     Create and wake up the thread for the main function. This must be the last thing
     we do, because once we wakeup the new thread it may run! so we need to have finished
@@ -196,23 +218,9 @@ Pid_t sys_Exec(Task call, int argl, void *args)
   if (call != NULL)
   {
     newproc->main_thread = spawn_thread(newproc, start_main_thread);
-
-    /* Allocate memory*/
-    PTCB *ptcb = (PTCB *)xmalloc(sizeof(PTCB));
-    newproc->main_thread->ptcb = ptcb;
-    ptcb->tcb = newproc->main_thread;
-
-    /* PTCB initialization */
-    ptcb->task = call;
-    ptcb->args = args;
-    ptcb->argl = argl;
-    ptcb->exited = 0;
-    ptcb->detached = 0;
-    ptcb->exit_cv = COND_INIT;
-    ptcb->refcount = 0;
-    newproc->thread_count++;
-    ptcb->ptcb_node_list = *rlnode_init(&ptcb->ptcb_node_list, ptcb);
-    rlist_push_back(&newproc->ptcb_list, &ptcb->ptcb_node_list);
+    Mutex_Lock(&newproc->lock);
+    acquire_PTCB(newproc, newproc->main_thread, call, argl, args);
+    Mutex_Unlock(&newproc->lock);
 
     wakeup(newproc->main_thread);
   }
@@ -227,11 +235,16 @@ Pid_t sys_GetPid()
   return get_pid(CURPROC);
 }
 
+/*
+  The parent of a live process only changes when it is reparented to
+  the init process, so reading it atomically is enough.
+ */
 Pid_t sys_GetPPid()
 {
-  return get_pid(CURPROC->parent);
+  return get_pid(__atomic_load_n(&CURPROC->parent, __ATOMIC_RELAXED));
 }
 
+/* Must be called with proc_lock held */
 static void cleanup_zombie(PCB *pcb, int *status)
 {
   if (status != NULL)
@@ -253,20 +266,31 @@ static Pid_t wait_for_specific_child(Pid_t cpid, int *status)
     goto finish;
   }
 
+  Mutex_Lock(&proc_lock);
+
   PCB *parent = CURPROC;
   PCB *child = get_pcb(cpid);
   if (child == NULL || child->parent != parent)
   {
     cpid = NOPROC;
-    goto finish;
+    goto unlock;
   }
 
   /* Ok, child is a legal child of mine. Wait for it to exit. */
   while (child->pstate == ALIVE)
-    kernel_wait(&parent->child_exit, SCHED_USER);
+    kernel_wait(&proc_lock, &parent->child_exit, SCHED_USER);
+
+  /* Another thread of mine may have cleaned it up while we woke up */
+  if (child->pstate != ZOMBIE || child->parent != parent)
+  {
+    cpid = NOPROC;
+    goto unlock;
+  }
 
   cleanup_zombie(child, status);
 
+unlock:
+  Mutex_Unlock(&proc_lock);
 finish:
   return cpid;
 }
@@ -277,6 +301,8 @@ static Pid_t wait_for_any_child(int *status)
 
   PCB *parent = CURPROC;
 
+  Mutex_Lock(&proc_lock);
+
   /* Make sure I have children! */
   int no_children, has_exited;
   while (1)
@@ -289,17 +315,21 @@ static Pid_t wait_for_any_child(int *status)
     if (has_exited)
       break;
 
-    kernel_wait(&parent->child_exit, SCHED_USER);
+    kernel_wait(&proc_lock, &parent->child_exit, SCHED_USER);
   }
 
   if (no_children)
+  {
+    Mutex_Unlock(&proc_lock);
     return NOPROC;
+  }
 
   PCB *child = parent->exited_list.next->pcb;
   assert(child->pstate == ZOMBIE);
   cpid = get_pid(child);
   cleanup_zombie(child, status);
 
+  Mutex_Unlock(&proc_lock);
   return cpid;
 }
 
@@ -376,8 +406,7 @@ Fid_t sys_OpenInfo()
   info->PCB_cursor=0;
 
   // Setting the FCB
-  fcb[0]->streamobj = info;
-  fcb[0]->streamfunc = &procinfo_file_ops;
+  FCB_publish(fcb[0], info, &procinfo_file_ops);
 
   return fid[0];
 }
@@ -403,6 +432,8 @@ int procinfo_read(void* procinfo1, char* buf, unsigned int size)
     return -1;
   }
 
+  Mutex_Lock(&proc_lock);
+
   /*Cross the PT table until we find a process that is not FREE*/
   while(PT[proc_cb->PCB_cursor].pstate == FREE){
 
@@ -411,6 +442,7 @@ int procinfo_read(void* procinfo1, char* buf, unsigned int size)
 
     // If we reach the end of the table, we return 0
     if(proc_cb->PCB_cursor==MAX_PROC){
+      Mutex_Unlock(&proc_lock);
       return 0;
     }
   }
@@ -424,8 +456,13 @@ int procinfo_read(void* procinfo1, char* buf, unsigned int size)
   proc_cb->procinfo.alive=(PT[proc_cb->PCB_cursor].pstate==ALIVE);
 
   /*Make thread_count of the procinfo (tinyos.h) to be the threadcount of the current process*/
+  Mutex_Lock(&PT[proc_cb->PCB_cursor].lock);
   proc_cb->procinfo.thread_count=PT[proc_cb->PCB_cursor].thread_count;
 
+  /*The PTCBs that have not been reclaimed*/
+  proc_cb->procinfo.ptcb_count=PT[proc_cb->PCB_cursor].ptcb_count;
+  Mutex_Unlock(&PT[proc_cb->PCB_cursor].lock);
+
   /*Make the main_task of the procinfo (tinyos.h) to be the main_task of the current process*/
   proc_cb->procinfo.main_task=PT[proc_cb->PCB_cursor].main_task;
 
@@ -443,12 +480,14 @@ int procinfo_read(void* procinfo1, char* buf, unsigned int size)
 
 
   memcpy(proc_cb->procinfo.args,(char*)PT[proc_cb->PCB_cursor].args, sizeof(char)*size_of_argl);
+  Mutex_Unlock(&proc_lock);
+
   memcpy(buf, (char*)&proc_cb->procinfo,sizeof(procinfo));
 
   /*Move to the next PCB*/
   proc_cb->PCB_cursor++;
 
-  return 1;
+  return sizeof(procinfo);
 }
 
 int procinfo_close(void* procinfo_cb)
@@ -459,5 +498,219 @@ int procinfo_close(void* procinfo_cb)
 
   free(procinfo_cb);
 
-  return 1;
-}
\ No newline at end of file
+  return 0;
+}
+
+/*--------------------------Scheduler Info--------------------------*/
+
+static int schedinfo_read(void* schedinfo_cb1, char* buf, unsigned int size);
+static int schedinfo_close(void* schedinfo_cb1);
+
+typedef struct schedinfo_cb
+{
+  uint core;    // The core of the next record
+  int level;    // The scheduler level of the next record
+}schedinfo_cb;
+
+// File operations for schedinfo
+static file_ops schedinfo_file_ops = {
+  .Read = schedinfo_read,
+  .Close = schedinfo_close
+};
+
+Fid_t sys_OpenSchedInfo()
+{
+  Fid_t fid[1];
+  FCB* fcb[1];
+
+  if(FCB_reserve(1, fid, fcb) == 0){
+      return NOFILE;
+  }
+
+  schedinfo_cb* info = (schedinfo_cb*)xmalloc(sizeof(schedinfo_cb));
+  info->core = 0;
+  info->level = 0;
+
+  FCB_publish(fcb[0], info, &schedinfo_file_ops);
+
+  return fid[0];
+}
+
+static int schedinfo_read(void* schedinfo_cb1, char* buf, unsigned int size)
+{
+  schedinfo_cb* cb = (schedinfo_cb*) schedinfo_cb1;
+
+  if(cb == NULL || size < sizeof(schedinfo)){
+    return -1;
+  }
+
+  /* Skip the levels with no waits recorded, until the last core */
+  schedinfo info;
+  while(cb->core < cpu_cores()){
+    unsigned long count = sched_wait_stats(cb->core, cb->level, &info);
+
+    /* Move the cursor to the next level */
+    if(++cb->level == SCHED_WAIT_LEVELS){
+      cb->level = 0;
+      cb->core++;
+    }
+
+    if(count > 0){
+      memcpy(buf, &info, sizeof(schedinfo));
+      return sizeof(schedinfo);
+    }
+  }
+
+  return 0;
+}
+
+static int schedinfo_close(void* schedinfo_cb1)
+{
+  if(schedinfo_cb1==NULL){
+    return -1;
+  }
+
+  free(schedinfo_cb1);
+
+  return 0;
+}
+
+/*--------------------------Stack Info--------------------------*/
+
+/*
+  The stack depths of exited threads, by task. This is an open-addressing
+  hash table on the task pointer; when it is full, new tasks are not 
+  recorded.
+ */
+#define STACK_TASKS 256
+
+static stackinfo stack_tasks[STACK_TASKS];
+static unsigned int stack_task_count;
+static Mutex stack_tasks_lock = MUTEX_INIT;  /* taken before proc_lock */
+
+void stack_stats_reset()
+{
+  memset(stack_tasks, 0, sizeof(stack_tasks));
+  stack_task_count = 0;
+}
+
+void stack_stats_record(Task task, size_t stack_size, size_t depth)
+{
+  uintptr_t h = ((uintptr_t)task >> 4) % STACK_TASKS;
+  Mutex_Lock(&stack_tasks_lock);
+  for(unsigned int i = 0; i < STACK_TASKS; i++, h = (h + 1) % STACK_TASKS){
+    stackinfo* rec = &stack_tasks[h];
+    if(rec->threads == 0){
+      rec->task = task;
+      rec->pid = NOPROC;
+      rec->tid = NOTHREAD;
+      stack_task_count++;
+    }
+    else if(rec->task != task)
+      continue;
+
+    rec->threads++;
+    if(stack_size > rec->stack_size) rec->stack_size = stack_size;
+    if(depth > rec->max_depth) rec->max_depth = depth;
+    break;
+  }
+  Mutex_Unlock(&stack_tasks_lock);
+}
+
+static int stackinfo_read(void* stackinfo_cb1, char* buf, unsigned int size);
+static int stackinfo_close(void* stackinfo_cb1);
+
+typedef struct stackinfo_cb
+{
+  unsigned int count;   // The number of records
+  unsigned int cursor;  // The next record
+  stackinfo rec[];      // The records, taken at open
+}stackinfo_cb;
+
+// File operations for stackinfo
+static file_ops stackinfo_file_ops = {
+  .Read = stackinfo_read,
+  .Close = stackinfo_close
+};
+
+Fid_t sys_OpenStackInfo()
+{
+  Fid_t fid[1];
+  FCB* fcb[1];
+
+  if(!sched_stack_paint_enabled() || FCB_reserve(1, fid, fcb) == 0){
+      return NOFILE;
+  }
+
+  /* 
+    The live threads are counted and then copied in separate passes, so
+    there may be new threads in between; those are left out.
+   */
+  Mutex_Lock(&stack_tasks_lock);
+  Mutex_Lock(&proc_lock);
+  unsigned int live = 0;
+  for(Pid_t p = 0; p < MAX_PROC; p++)
+    if(PT[p].pstate == ALIVE)
+      live += PT[p].thread_count;
+
+  stackinfo_cb* info = (stackinfo_cb*)xmalloc(sizeof(stackinfo_cb) + (live + stack_task_count)*sizeof(stackinfo));
+  info->count = 0;
+  info->cursor = 0;
+
+  /* The live threads first... */
+  for(Pid_t p = 0; p < MAX_PROC; p++){
+    if(PT[p].pstate != ALIVE) continue;
+    Mutex_Lock(&PT[p].lock);
+    for(rlnode* n = PT[p].ptcb_list.next; n != &PT[p].ptcb_list; n = n->next){
+      PTCB* ptcb = n->obj;
+      if(ptcb->exited) continue;
+      if(info->count == live) break;
+      stackinfo* rec = &info->rec[info->count++];
+      rec->task = ptcb->task;
+      rec->pid = p;
+      rec->tid = ptcb->tid;
+      rec->threads = 1;
+      rec->stack_size = ptcb->tcb->stack_size;
+      rec->max_depth = thread_stack_depth(ptcb->tcb);
+    }
+    Mutex_Unlock(&PT[p].lock);
+  }
+  Mutex_Unlock(&proc_lock);
+
+  /* ... and then the tasks of the exited threads */
+  for(unsigned int i = 0; i < STACK_TASKS; i++)
+    if(stack_tasks[i].threads > 0)
+      info->rec[info->count++] = stack_tasks[i];
+  Mutex_Unlock(&stack_tasks_lock);
+
+  FCB_publish(fcb[0], info, &stackinfo_file_ops);
+
+  return fid[0];
+}
+
+static int stackinfo_read(void* stackinfo_cb1, char* buf, unsigned int size)
+{
+  stackinfo_cb* cb = (stackinfo_cb*) stackinfo_cb1;
+
+  if(cb == NULL || size < sizeof(stackinfo)){
+    return -1;
+  }
+
+  if(cb->cursor == cb->count){
+    return 0;
+  }
+
+  memcpy(buf, &cb->rec[cb->cursor++], sizeof(stackinfo));
+  return sizeof(stackinfo);
+}
+
+static int stackinfo_close(void* stackinfo_cb1)
+{
+  if(stackinfo_cb1==NULL){
+    return -1;
+  }
+
+  free(stackinfo_cb1);
+
+  return 0;
+}
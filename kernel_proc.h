@@ -30,6 +30,21 @@ typedef enum pid_state_e {
   ZOMBIE  /**< @brief The PID is held by a zombie */
 } pid_state;
 
+/**
+  @brief A slot of the thread handle table of a process.
+
+  A @c Tid_t encodes the index of a slot and the generation of the slot when
+  the tid was issued. The generation is advanced each time the slot is
+  released, so a stale tid never refers to a later thread.
+
+  @see get_ptcb
+ */
+typedef struct thread_handle {
+  PTCB* ptcb;             /**< @brief The thread of the slot, or NULL if the slot is free */
+  uintptr_t gen;          /**< @brief The current generation of the slot */
+  int next_free;          /**< @brief The next free slot, or -1 */
+} thread_handle;
+
 /**
   @brief Process Control Block.
 
@@ -38,6 +53,8 @@ typedef enum pid_state_e {
 typedef struct process_control_block {
   pid_state  pstate;      /**< @brief The pid state for this PCB */
 
+  Mutex lock;             /**< @brief Protects @c FIDT and the threads of the process */
+
   PCB* parent;            /**< @brief Parent's pcb. */
   int exitval;            /**< @brief The exit value of the process */
 
@@ -61,6 +78,11 @@ typedef struct process_control_block {
   FCB* FIDT[MAX_FILEID];  /**< @brief The fileid table of the process */
   rlnode ptcb_list;
   int thread_count;
+  int ptcb_count;         /**< @brief The number of PTCBs in @c ptcb_list */
+
+  thread_handle* thread_table;  /**< @brief The thread handle table, indexed by tid */
+  int thread_table_size;        /**< @brief The number of slots of @c thread_table */
+  int thread_table_free;        /**< @brief The first free slot of @c thread_table, or -1 */
 
 } PCB;
 
@@ -81,11 +103,69 @@ typedef struct process_thread_control_block {
   int refcount;           
 
   rlnode ptcb_node_list;  /**< @brief Lists of nodes of PTCB */
+
+  Tid_t tid;              /**< @brief The tid of the thread */
   
 } PTCB;
 
 void start_main_thread_process();
 
+/**
+  @brief Create the PTCB of a new thread of a process.
+
+  The PTCB is taken from a pool, connected to @c tcb, added to the
+  thread list of @c pcb and given a slot in its thread handle table.
+
+  Must be called with @c pcb->lock held.
+
+  @param pcb the process of the thread
+  @param tcb the thread
+  @param task the task of the thread
+  @param argl the first argument of @c task
+  @param args the second argument of @c task
+  @returns the new PTCB
+*/
+PTCB* acquire_PTCB(PCB* pcb, TCB* tcb, Task task, int argl, void* args);
+
+/**
+  @brief Release the PTCB of a thread of a process.
+
+  The PTCB is removed from its process and returned to the pool. Its
+  tid becomes stale. This happens when an exited thread has been joined,
+  or when a detached thread exits and no joiner is still waking up.
+
+  Must be called with @c pcb->lock held.
+*/
+void release_PTCB(PCB* pcb, PTCB* ptcb);
+
+/**
+  @brief Release the PTCBs and the thread handle table of a process.
+
+  Must be called with @c pcb->lock held.
+*/
+void release_thread_table(PCB* pcb);
+
+/**
+  @brief Get the PTCB for a tid.
+
+  The lookup takes constant time. Must be called with @c pcb->lock held.
+
+  @param pcb the process of the thread
+  @param tid the tid of the thread
+  @returns A pointer to the PTCB of the thread, or NULL if @c tid is not
+    a current tid of a thread of @c pcb.
+*/
+PTCB* get_ptcb(PCB* pcb, Tid_t tid);
+
+/**
+  @brief The lock of the process table.
+
+  This lock protects the state of the PCBs, their free list, the process
+  tree and the exited lists of the processes. It is taken before any
+  @c PCB.lock.
+*/
+extern Mutex proc_lock;
+
 /**
   @brief Initialize the process table.
 
@@ -118,6 +198,24 @@ PCB* get_pcb(Pid_t pid);
 */
 Pid_t get_pid(PCB* pcb);
 
+/**
+  @brief Record the stack depth reached by an exited thread.
+
+  The depths are kept per task, for the stack information streams.
+
+  @param task the task of the thread
+  @param stack_size the stack size of the thread
+  @param depth the maximum stack depth reached by the thread
+  @see OpenStackInfo
+  @see thread_stack_depth
+*/
+void stack_stats_record(Task task, size_t stack_size, size_t depth);
+
+/**
+  @brief Clear the stack depths recorded by @c stack_stats_record.
+*/
+void stack_stats_reset();
+
 /** @} */
 
 #endif
@@ -34,8 +34,13 @@ CCB cctx[MAX_CORES];
 */
 #define CURTHREAD (CURCORE.current_thread)
 
-#define PRIORITY_QUEUES 50	// number of queues
 #define MAX_CALLS 1000	// max calls of yield() until we boost each thread's priority by 1
+
+#if defined(SCHED_STATISTICS)
+#define SCHED_STAT_INC(core, field) ((core)->field++)
+#else
+#define SCHED_STAT_INC(core, field)
+#endif
 /*
 	This can be used in the preemptive context to
 	obtain the current thread.
@@ -53,35 +58,40 @@ TCB *cur_thread()
    The thread layout.
   --------------------
 
-  On the x86 (Pentium) architecture, the stack grows upward. Therefore, we
-  can allocate the TCB at the top of the memory block used as the stack.
+  A thread is allocated as one block (the thread block), holding its TCB
+  and its stack. The stack grows downward, from the top of the block
+  towards the TCB, and a guard page between the two is mapped PROT_NONE
+  (see allocate_thread()).
 
+  +-------------+  <- block + THREAD_SIZE(stack_size)
+  | first frame |
   +-------------+
-  |   TCB       |
-  +-------------+
-  |             |
+  |      |      |
+  |      v      |
   |    stack    |
   |             |
-  |      ^      |
-  |      |      |
-  +-------------+
-  | first frame |
+  +-------------+  <- thread_stack(tcb)
+  | guard page  |
   +-------------+
+  |   TCB       |
+  +-------------+  <- block
 
-  Advantages: (a) unified memory area for stack and TCB (b) stack overrun will
-  crash own thread, before it affects other threads (which may make debugging
-  easier).
+  Advantages: (a) unified memory area for stack and TCB (b) stack overrun
+  faults on the guard page, before it corrupts the TCB or other threads.
 
-  Disadvantages: The stack cannot grow unless we move the whole TCB. Of course,
-  we do not support stack growth anyway!
+  The stack size is fixed at creation, and rounded up to a size class 
+  (THREAD_MIN_STACK_SIZE or THREAD_STACK_SIZE), so that the blocks of 
+  exited threads can be cached and reused (see the thread block cache 
+  below). Larger stacks are rounded up to a whole page, and not cached.
  */
 
 /*
   A counter for active threads. By "active", we mean 'existing',
-  with the exception of idle threads (they don't count).
+  with the exception of idle threads (they don't count). An exited
+  thread stops counting when it leaves its core, even if its thread
+  block has not been released yet.
  */
 volatile unsigned int active_threads = 0;
-Mutex active_threads_spinlock = MUTEX_INIT;
 
 /* This is specific to Intel Pentium! */
 #define SYSTEM_PAGE_SIZE (1 << 12)
@@ -90,25 +100,34 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 #define THREAD_TCB_SIZE \
 	(((sizeof(TCB) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
 
-#define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_STACK_SIZE)
-
-// #define MMAPPED_THREAD_MEM
+#define MMAPPED_THREAD_MEM
 #ifdef MMAPPED_THREAD_MEM
 
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
+  Use mmap to allocate a thread. The block is laid out as
+
+     [ TCB pages | guard page | stack ... ]
+
+  The stack grows down towards the guard page, which is mapped PROT_NONE, 
+  so that a stack overflow is a segmentation fault, instead of silent 
+  corruption of the TCB. The block is reserved with MAP_NORESERVE, and
+  the host commits its pages on first touch, so that the resident memory 
+  of a thread is proportional to the stack it has actually used.
  */
+#define THREAD_GUARD_SIZE SYSTEM_PAGE_SIZE
+
 void free_thread(void *ptr, size_t size) { CHECK(munmap(ptr, size)); }
 
 void *allocate_thread(size_t size)
 {
-	void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
-					 MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+					 MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
 
 	CHECK((ptr == MAP_FAILED) ? -1 : 0);
 
+	/* The guard page */
+	CHECK(mprotect(ptr + THREAD_TCB_SIZE, THREAD_GUARD_SIZE, PROT_NONE));
+
 	return ptr;
 }
 #else
@@ -116,6 +135,8 @@ void *allocate_thread(size_t size)
   Use malloc to allocate a thread. This is probably faster than  mmap, but
   cannot be made easily to 'detect' stack overflow.
  */
+#define THREAD_GUARD_SIZE 0
+
 void free_thread(void *ptr, size_t size) { free(ptr); }
 
 void *allocate_thread(size_t size)
@@ -126,6 +147,152 @@ void *allocate_thread(size_t size)
 }
 #endif
 
+/* The size of a thread block with the given stack size */
+#define THREAD_SIZE(stack_size) (THREAD_TCB_SIZE + THREAD_GUARD_SIZE + (stack_size))
+
+/*
+  Thread block cache.
+
+  Released thread blocks (TCB and stack) are recycled, so that creating
+  a thread does not normally call the host allocator. There is a cache
+  for each of the TCB_CLASSES stack sizes in tcb_class_stack[]; a stack
+  is rounded up to the smallest class that fits, and larger stacks are
+  not cached.
+
+  Each core keeps a free list per class, which only the core itself 
+  touches, with preemption off. A core whose list grows above 
+  TCB_CACHE_HIGH moves all but TCB_CACHE_LOW of its blocks to a global 
+  pool, and a core whose list is empty takes up to TCB_CACHE_LOW blocks 
+  from the pool. Blocks that do not fit in the pool (TCB_POOL_MAX) are 
+  freed, after the pool lock is released.
+*/
+#define TCB_CACHE_LOW 4
+#define TCB_CACHE_HIGH 16
+#define TCB_POOL_MAX 64
+
+static const size_t tcb_class_stack[TCB_CLASSES] = {THREAD_MIN_STACK_SIZE, THREAD_STACK_SIZE};
+
+typedef struct thread_block
+{
+	struct thread_block *next;
+} thread_block;
+
+static struct
+{
+	Spinlock lock;
+	thread_block *head;
+	uint count;
+} tcb_pool[TCB_CLASSES] = {{SPINLOCK_INIT, NULL, 0}, {SPINLOCK_INIT, NULL, 0}};
+
+/* The class of a stack size, or -1 if it is not cached */
+static inline int tcb_class(size_t stack_size)
+{
+	for (int k = 0; k < TCB_CLASSES; k++)
+		if (stack_size <= tcb_class_stack[k])
+			return k;
+	return -1;
+}
+
+/* Free a list of thread blocks of class k */
+static void tcb_free_list(thread_block *b, int k)
+{
+	while (b != NULL)
+	{
+		thread_block *next = b->next;
+		free_thread(b, THREAD_SIZE(tcb_class_stack[k]));
+		b = next;
+	}
+}
+
+/* 
+  Get a thread block for a stack of (at least) the given size, 
+  preferably from the cache. The actual stack size is stored in
+  *stack_size.
+*/
+static TCB *tcb_alloc(size_t *stack_size)
+{
+	int k = tcb_class(*stack_size);
+	if (k < 0)
+	{
+		*stack_size = (*stack_size + SYSTEM_PAGE_SIZE - 1) & ~(size_t)(SYSTEM_PAGE_SIZE - 1);
+		return (TCB *)allocate_thread(THREAD_SIZE(*stack_size));
+	}
+	*stack_size = tcb_class_stack[k];
+
+	int preempt = preempt_off;
+	CCB *core = &CURCORE;
+
+	/* Refill from the pool */
+	if (core->tcb_cache[k] == NULL && tcb_pool[k].count > 0)
+	{
+		Spinlock_Lock(&tcb_pool[k].lock);
+		while (tcb_pool[k].head != NULL && core->tcb_cache_count[k] < TCB_CACHE_LOW)
+		{
+			thread_block *b = tcb_pool[k].head;
+			tcb_pool[k].head = b->next;
+			tcb_pool[k].count--;
+			b->next = core->tcb_cache[k];
+			core->tcb_cache[k] = b;
+			core->tcb_cache_count[k]++;
+		}
+		Spinlock_Unlock(&tcb_pool[k].lock);
+	}
+
+	thread_block *b = core->tcb_cache[k];
+	if (b != NULL)
+	{
+		core->tcb_cache[k] = b->next;
+		core->tcb_cache_count[k]--;
+		SCHED_STAT_INC(core, tcb_cache_hits);
+	}
+	else
+		SCHED_STAT_INC(core, tcb_cache_misses);
+
+	if (preempt)
+		preempt_on;
+
+	return (b != NULL) ? (TCB *)b : (TCB *)allocate_thread(THREAD_SIZE(*stack_size));
+}
+
+/* Return a thread block to the cache (called with preemption off) */
+static void tcb_free(TCB *tcb)
+{
+	int k = tcb_class(tcb->stack_size);
+	if (k < 0)
+	{
+		free_thread(tcb, THREAD_SIZE(tcb->stack_size));
+		return;
+	}
+
+	CCB *core = &CURCORE;
+	thread_block *b = (thread_block *)tcb;
+	b->next = core->tcb_cache[k];
+	core->tcb_cache[k] = b;
+	if (++core->tcb_cache_count[k] <= TCB_CACHE_HIGH)
+		return;
+
+	/* Keep TCB_CACHE_LOW blocks, spill the rest */
+	thread_block *last = core->tcb_cache[k];
+	for (int i = 1; i < TCB_CACHE_LOW; i++)
+		last = last->next;
+	thread_block *spill = last->next;
+	last->next = NULL;
+	core->tcb_cache_count[k] = TCB_CACHE_LOW;
+
+	Spinlock_Lock(&tcb_pool[k].lock);
+	while (spill != NULL && tcb_pool[k].count < TCB_POOL_MAX)
+	{
+		b = spill;
+		spill = b->next;
+		b->next = tcb_pool[k].head;
+		tcb_pool[k].head = b;
+		tcb_pool[k].count++;
+	}
+	Spinlock_Unlock(&tcb_pool[k].lock);
+
+	tcb_free_list(spill, k);
+}
+
 /*
   This is the function that is used to start normal threads.
 */
@@ -145,10 +312,52 @@ static void thread_start()
   Initialize and return a new TCB
 */
 
+/* The lowest address of the stack of a thread */
+static inline void *thread_stack(TCB *tcb)
+{
+	return ((void *)tcb) + THREAD_TCB_SIZE + THREAD_GUARD_SIZE;
+}
+
+/*
+  Stack painting.
+
+  When enabled, the stack of every new thread is filled with STACK_PAINT.
+  Since the stack grows down, the depth reached by a thread is the distance
+  from the top of the stack to the lowest word that no longer holds the
+  pattern. Painting touches every page of the stack, so that it defeats
+  the lazy commit of stack memory; it is meant for measurements only.
+ */
+#define STACK_PAINT 0xA5
+#define STACK_PAINT_WORD ((uintptr_t)0xA5A5A5A5A5A5A5A5ull)
+
+static int stack_paint = 0;
+
+void sched_set_stack_paint(int enable) { stack_paint = enable; }
+
+int sched_stack_paint_enabled() { return stack_paint; }
+
+size_t thread_stack_depth(TCB *tcb)
+{
+	if (!stack_paint)
+		return 0;
+
+	uintptr_t *p = thread_stack(tcb);
+	uintptr_t *top = p + tcb->stack_size / sizeof(uintptr_t);
+	while (p < top && *p == STACK_PAINT_WORD)
+		p++;
+	return (char *)top - (char *)p;
+}
+
 TCB *spawn_thread(PCB *pcb, void (*func)())
+{
+	return spawn_thread_stack(pcb, func, THREAD_STACK_SIZE);
+}
+
+TCB *spawn_thread_stack(PCB *pcb, void (*func)(), size_t stack_size)
 {
 	/* The allocated thread size must be a multiple of page size */
-	TCB *tcb = (TCB *)allocate_thread(THREAD_SIZE);
+	TCB *tcb = tcb_alloc(&stack_size);
+	tcb->stack_size = stack_size;
 
 	/* Set the owner */
 	tcb->owner_pcb = pcb;
@@ -157,6 +366,16 @@ TCB *spawn_thread(PCB *pcb, void (*func)())
 	tcb->type = NORMAL_THREAD;
 	tcb->state = INIT;
 	tcb->phase = CTX_CLEAN;
+	tcb->state_spinlock = SPINLOCK_INIT;
+	tcb->priority = 0;
+	tcb->rq_core = NOCORE;
+	tcb->ready_time = 0;
+	tcb->sclass = SCHED_CLASS_NORMAL;
+	tcb->rt_priority = 0;
+	tcb->last_core = cpu_core_id; /* First run on the creating core */
+	tcb->vruntime = CURCORE.min_vruntime;
+	tcb->vruntime_core = cpu_core_id;
+	avlnode_init(&tcb->cfs_node, tcb);
 	tcb->thread_func = func;
 	tcb->wakeup_time = NO_TIMEOUT;
 	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
@@ -167,187 +386,1069 @@ TCB *spawn_thread(PCB *pcb, void (*func)())
 	tcb->curr_cause = SCHED_IDLE;
 
 	/* Compute the stack segment address and size */
-	void *sp = ((void *)tcb) + THREAD_TCB_SIZE;
+	void *sp = thread_stack(tcb);
+	if (stack_paint)
+		memset(sp, STACK_PAINT, stack_size);
 
 	/* Init the context */
-	cpu_initialize_context(&tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+	cpu_initialize_context(&tcb->context, sp, stack_size, thread_start);
 
 #ifndef NVALGRIND
-	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + THREAD_STACK_SIZE);
+	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + stack_size);
 #endif
 
 	/* increase the count of active threads */
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads++;
-	Mutex_Unlock(&active_threads_spinlock);
+	__atomic_add_fetch(&active_threads, 1, __ATOMIC_SEQ_CST);
+
+	return tcb;
+}
+
+/*
+  Deferred release of exited threads.
+
+  When an exited thread leaves its core, gain() only queues it on the
+  dead_list of the core. The thread blocks are released in batches by
+  reap_threads(): by the idle thread before it halts, or by gain() when
+  TCB_REAP_BATCH threads have accumulated on a busy core. Thus, the
+  release (valgrind deregistration, cache spills, munmap) is kept out of
+  the common path of a context switch.
+ */
+#define TCB_REAP_BATCH 32
+
+/* Queue an exited thread for release (called with preemption off) */
+static void defer_release_TCB(CCB *core, TCB *tcb)
+{
+	rlist_push_back(&core->dead_list, &tcb->sched_node);
+	core->dead_count++;
+	__atomic_sub_fetch(&active_threads, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Release the exited threads of this core (called with preemption off) */
+static void reap_threads(CCB *core)
+{
+	while (!is_rlist_empty(&core->dead_list))
+	{
+		TCB *tcb = rlist_pop_front(&core->dead_list)->tcb;
+#ifndef NVALGRIND
+		VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
+#endif
+		tcb_free(tcb);
+	}
+	core->dead_count = 0;
+}
+
+/*
+ *
+ * Scheduler
+ *
+ */
+
+/*
+ *  Note: the scheduler routines are all in the non-preemptive domain.
+ */
+
+/*
+  Each core has its own ready queue (an array of PRIORITY_QUEUES lists,
+  one per MLFQ level), stored in its CCB and protected by the core's
+  @c rq_spinlock. There is no global scheduler lock.
+
+  The state of a thread (fields state, phase and wakeup_time) is protected
+  by the thread's own @c state_spinlock. The lock order is
+
+     TCB state_spinlock  -->  rq_spinlock
+     TCB state_spinlock  -->  timer_spinlock
+
+  At most one rq_spinlock is held at any time.
+
+  Also, each core has a timer wheel of the threads that went to sleep with 
+  a timeout on that core, protected by the core's @c timer_spinlock. Expired 
+  timeouts are processed with the timer_spinlock held, therefore the TCB 
+  lock is taken with Spinlock_TryLock() in that case.
+
+  Code may hold more than one state spinlock only if it is
+  wakeup_many(), or if it takes all but the first of them with 
+  Spinlock_TryLock(). Then, no two holders can wait for each other.
+*/
+
+/*
+  Re-arm the quantum timer of a tickless core, because some thread has 
+  been queued at it. A thread without a quantum stays tickless.
+*/
+static void sched_rearm_quantum(CCB *core)
+{
+	TCB *current = core->current_thread;
+	if (current->rts == 0)
+		return;
+	core->tickless = 0;
+	bios_set_timer(current->rts);
+}
+
+/* Interrupt handler for ALARM */
+void yield_handler() { yield(SCHED_QUANTUM); }
+
+/* Interrupt handle for inter-core interrupts */
+void ici_handler()
+{
+	CCB *core = &CURCORE;
+
+	/* A higher-priority thread has been queued at this core */
+	if (__atomic_exchange_n(&core->preempt_pending, 0, __ATOMIC_ACQ_REL))
+	{
+		yield(SCHED_PREEMPT);
+		return;
+	}
+
+	/* Some thread may have been queued at this core, while in tickless mode */
+	if (core->ready_count == 0)
+		return;
+
+	if (core->current_thread->type == IDLE_THREAD)
+		yield(SCHED_IDLE);
+	else if (core->tickless)
+		sched_rearm_quantum(core);
+}
+
+/*
+  Possibly add TCB to the timer wheel of the current core.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static void sched_register_timeout(TCB *tcb, TimerDuration timeout)
+{
+	if (timeout != NO_TIMEOUT)
+	{
+		CCB *core = &CURCORE;
+
+		/* set the wakeup time */
+		TimerDuration curtime = bios_clock();
+		tcb->wakeup_time = curtime + timeout;
+		tcb->timer_core = core->id;
+
+		Spinlock_Lock(&core->timer_spinlock);
+
+		/* add to the wheel slot of its tick, but not before the current tick */
+		TimerDuration tick = tcb->wakeup_time / TIMER_WHEEL_TICK;
+		if (tick < core->timer_tick)
+			tick = core->timer_tick;
+		rlist_push_back(&core->timer_wheel[tick % TIMER_WHEEL_SLOTS], &tcb->sched_node);
+		core->timer_count++;
+
+		Spinlock_Unlock(&core->timer_spinlock);
+	}
+}
+
+/*
+  Scheduler policies.
+
+  The order in which the ready threads of a core are run is decided by a
+  scheduler policy, i.e., a table of operations on the ready queue of a
+  core (the ready_queue lists, ready_bitmap and epoch fields of the CCB,
+  whose meaning is up to the policy). The policy is selected at boot time
+  by sched_select_policy(), and cannot change while the scheduler runs.
+*/
+typedef struct sched_policy
+{
+	const char *name;
+
+	/* Add tcb to the ready queue (core->rq_spinlock held) */
+	void (*enqueue)(CCB *core, TCB *tcb);
+
+	/* Remove a specific queued tcb from the ready queue (core->rq_spinlock held) */
+	void (*dequeue)(CCB *core, TCB *tcb);
+
+	/* Remove and return the next thread to run, or NULL (core->rq_spinlock held) */
+	TCB *(*pick_next)(CCB *core);
+
+	/* Called by yield() for the thread whose timeslice ended (no locks held) */
+	void (*on_yield)(CCB *core, TCB *tcb, enum SCHED_CAUSE cause);
+
+	/* Called by yield() at every reschedule of the core (no locks held) */
+	void (*on_tick)(CCB *core);
+
+	/* Return the length of the next time-slice of tcb at core (no locks held) */
+	TimerDuration (*timeslice)(CCB *core, TCB *tcb);
+} sched_policy;
+
+/* The time-slice of the MLFQ and round-robin policies */
+static TimerDuration quantum_timeslice(CCB *core, TCB *tcb) { return QUANTUM; }
+
+/*
+  The MLFQ policy.
+
+  The RQ_SLOTS lists of a core form a ring; a thread of level L is queued
+  at slot (L - epoch) mod RQ_SLOTS. Incrementing the core's epoch therefore
+  raises every queued thread by one level, without touching it; only the
+  list that would rise above the top level is merged into the new top list.
+  The priority of a queued thread is brought up to date lazily, when it is
+  dequeued.
+
+  Bit s of ready_bitmap is set iff slot s is non-empty. Rotating the bitmap
+  by the epoch gives a bitmap of non-empty levels, so that the highest level
+  is found by a single count-leading-zeros.
+*/
+_Static_assert(PRIORITY_QUEUES < RQ_SLOTS && RQ_SLOTS <= 64 && (RQ_SLOTS & (RQ_SLOTS - 1)) == 0,
+			   "Illegal RQ_SLOTS");
+
+static inline uint mlfq_slot(CCB *core, int level)
+{
+	return ((uint)level - core->epoch) % RQ_SLOTS;
+}
+
+/* The current level of a queued thread */
+static inline int mlfq_level(CCB *core, TCB *tcb)
+{
+	int level = tcb->priority + (int)(core->epoch - tcb->rq_epoch);
+	return (level < PRIORITY_QUEUES) ? level : PRIORITY_QUEUES - 1;
+}
+
+static void mlfq_enqueue(CCB *core, TCB *tcb)
+{
+	uint s = mlfq_slot(core, tcb->priority);
+	rlist_push_back(&core->ready_queue[s], &tcb->sched_node);
+	core->ready_bitmap |= 1ull << s;
+	tcb->rq_epoch = core->epoch;
+}
+
+static void mlfq_dequeue(CCB *core, TCB *tcb)
+{
+	int level = mlfq_level(core, tcb);
+	uint s = mlfq_slot(core, level);
+	rlist_remove(&tcb->sched_node);
+	if (is_rlist_empty(&core->ready_queue[s]))
+		core->ready_bitmap &= ~(1ull << s);
+	tcb->priority = level;
+}
+
+static TCB *mlfq_pick_next(CCB *core)
+{
+	uint64_t bitmap = core->ready_bitmap;
+	if (bitmap == 0)
+		return NULL;
+
+	/* Rotate the slot bitmap into a level bitmap and find the top level */
+	uint r = core->epoch % RQ_SLOTS;
+	uint64_t levels = (r == 0) ? bitmap : (bitmap << r) | (bitmap >> (64 - r));
+	int level = 63 - __builtin_clzll(levels);
+
+	uint s = mlfq_slot(core, level);
+	TCB *tcb = rlist_pop_front(&core->ready_queue[s])->tcb;
+	if (is_rlist_empty(&core->ready_queue[s]))
+		core->ready_bitmap &= ~(1ull << s);
+
+	/* The aging of tcb while queued takes effect now */
+	assert(level == mlfq_level(core, tcb));
+	tcb->priority = level;
+	return tcb;
+}
+
+/*
+  Adjust the priority of a thread, according to the cause of the end
+  of its timeslice.
+*/
+static void mlfq_on_yield(CCB *core, TCB *tcb, enum SCHED_CAUSE cause)
+{
+	/* Case 2: SCHED_QUANTUM - Thread quantum has expired (a tickless ALARM is a timeout, not a quantum) */
+	if (cause == SCHED_QUANTUM && !core->tickless)	// thread use the quantum and has not completed its job
+	{
+		if (tcb->priority > 0)
+		{
+			tcb->priority--;
+		}
+	}
+
+	/* Case 3: SCHEND_IO - Interactive thread (I/O) */
+	if (cause == SCHED_IO)	// thread uses I/O but the quantum has passed
+	{
+		if (tcb->priority < PRIORITY_QUEUES - 1)
+		{
+			tcb->priority++;
+		}
+	}
+
+	/* Case 4: SCHED_MUTEX - Priority inversion */
+	if (cause == tcb->last_cause && tcb->last_cause == SCHED_MUTEX)	// mutex is locked by a lower priority thread
+	{
+		if (tcb->priority > 0)
+		{
+			tcb->priority--;
+		}
+	}
+}
+
+/*
+  After MAX_CALLS calls of yield(), boost every thread of this core by 1,
+  by advancing the epoch. This is O(1).
+*/
+static void mlfq_on_tick(CCB *core)
+{
+	if (core->yield_count < MAX_CALLS)
+	{
+		core->yield_count++;
+		return;
+	}
+	core->yield_count = 0;
+
+	Spinlock_Lock(&core->rq_spinlock);
+	uint top = mlfq_slot(core, PRIORITY_QUEUES - 1);
+	core->epoch++;
+	uint newtop = mlfq_slot(core, PRIORITY_QUEUES - 1);
+
+	/* The old top level is clamped into the new top level, ahead of it */
+	if (core->ready_bitmap & (1ull << top))
+	{
+		rlist_prepend(&core->ready_queue[newtop], &core->ready_queue[top]);
+		core->ready_bitmap &= ~(1ull << top);
+		core->ready_bitmap |= 1ull << newtop;
+	}
+	Spinlock_Unlock(&core->rq_spinlock);
+}
+
+static const sched_policy mlfq_policy = {
+	.name = "mlfq",
+	.enqueue = mlfq_enqueue,
+	.dequeue = mlfq_dequeue,
+	.pick_next = mlfq_pick_next,
+	.on_yield = mlfq_on_yield,
+	.on_tick = mlfq_on_tick,
+	.timeslice = quantum_timeslice};
+
+/*
+  The round-robin policy.
+
+  All threads keep priority 0 and share a single FIFO list, ready_queue[0].
+*/
+static void rr_enqueue(CCB *core, TCB *tcb)
+{
+	rlist_push_back(&core->ready_queue[0], &tcb->sched_node);
+}
+
+static void rr_dequeue(CCB *core, TCB *tcb)
+{
+	rlist_remove(&tcb->sched_node);
+}
+
+static TCB *rr_pick_next(CCB *core)
+{
+	if (is_rlist_empty(&core->ready_queue[0]))
+		return NULL;
+	return rlist_pop_front(&core->ready_queue[0])->tcb;
+}
+
+static void rr_on_yield(CCB *core, TCB *tcb, enum SCHED_CAUSE cause) {}
+
+static void rr_on_tick(CCB *core) {}
+
+static const sched_policy rr_policy = {
+	.name = "rr",
+	.enqueue = rr_enqueue,
+	.dequeue = rr_dequeue,
+	.pick_next = rr_pick_next,
+	.on_yield = rr_on_yield,
+	.on_tick = rr_on_tick,
+	.timeslice = quantum_timeslice};
+
+/*
+  The completely fair (CFS) policy.
+
+  Each thread accumulates its measured run time into its virtual run time,
+  and the ready thread with the smallest vruntime runs next. The ready 
+  threads of a core are kept in a balanced tree ordered by vruntime.
+
+  The time-slice is the scheduling period CFS_LATENCY divided among the
+  ready threads, but never below CFS_MIN_GRANULARITY, to bound the 
+  switching overhead.
+
+  Each core keeps a min_vruntime, which only moves forward. It follows the
+  smaller of the vruntimes of the current thread and of the leftmost ready
+  thread. A thread that runs alone is tickless and does not yield, so its
+  run time so far is also counted when a thread is queued at its core.
+
+  A thread that wakes up after a long sleep is placed at most 
+  CFS_SLEEP_CREDIT before min_vruntime, so that it cannot monopolize the
+  core. A thread that moves to another core keeps its lag relative to the
+  min_vruntime of its old core.
+
+  MLFQ priorities are ignored.
+*/
+#define CFS_LATENCY (20000L)
+#define CFS_MIN_GRANULARITY (2000L)
+#define CFS_SLEEP_CREDIT (CFS_LATENCY / 2)
+
+/*
+  Advance the min_vruntime of a core, given the vruntime of its current
+  thread. Called with the rq_spinlock of the core held.
+*/
+static void cfs_update_min_vruntime(CCB *core, TimerDuration curr_vruntime)
+{
+	TimerDuration vruntime = curr_vruntime;
+	avlnode *first = core->cfs_tree.first;
+	if (first != NULL && first->tcb->vruntime < vruntime)
+		vruntime = first->tcb->vruntime;
+	if (vruntime > core->min_vruntime)
+		core->min_vruntime = vruntime;
+}
+
+static void cfs_enqueue(CCB *core, TCB *tcb)
+{
+	/* The lag of tcb behind the min_vruntime of its core */
+	int64_t lag = (int64_t)(tcb->vruntime - cctx[tcb->vruntime_core].min_vruntime);
+	if (lag < -CFS_SLEEP_CREDIT)
+		lag = -CFS_SLEEP_CREDIT;
+
+	/* Count the run time of the current thread. Only for this core, since
+	   the current thread of another core may be released at any time. 
+	   Before the scheduler runs, there is no current thread. */
+	TCB *curr = core->current_thread;
+	if (core == &CURCORE && curr != NULL && curr->type != IDLE_THREAD && curr->sclass == SCHED_CLASS_NORMAL)
+		cfs_update_min_vruntime(core, curr->vruntime + (bios_clock_precise() - curr->slice_start));
+
+	/* Move it to the clock of this core */
+	if (lag < 0 && (TimerDuration)(-lag) > core->min_vruntime)
+		tcb->vruntime = 0;
+	else
+		tcb->vruntime = core->min_vruntime + lag;
+	tcb->vruntime_core = core->id;
+
+	tcb->cfs_node.key = tcb->vruntime;
+	avl_insert(&core->cfs_tree, &tcb->cfs_node);
+}
+
+static void cfs_dequeue(CCB *core, TCB *tcb)
+{
+	avl_remove(&core->cfs_tree, &tcb->cfs_node);
+}
+
+static TCB *cfs_pick_next(CCB *core)
+{
+	avlnode *first = core->cfs_tree.first;
+	if (first == NULL)
+		return NULL;
+	avl_remove(&core->cfs_tree, first);
+
+	TCB *tcb = first->tcb;
+	if (tcb->vruntime > core->min_vruntime)
+		core->min_vruntime = tcb->vruntime;
+	return tcb;
+}
+
+static TimerDuration cfs_timeslice(CCB *core, TCB *tcb)
+{
+	TimerDuration slice = CFS_LATENCY / (core->ready_count + 1);
+	return (slice > CFS_MIN_GRANULARITY) ? slice : CFS_MIN_GRANULARITY;
+}
+
+/*
+  A thread that yields on a busy Mutex is charged at least a whole
+  time-slice. Else, the waiters of a Mutex whose holder was preempted
+  would keep running ahead of it, each for a short spin.
+*/
+static void cfs_on_yield(CCB *core, TCB *tcb, enum SCHED_CAUSE cause)
+{
+	TimerDuration now = bios_clock_precise();
+	TimerDuration ran = now - tcb->slice_start;
+	if (cause == SCHED_MUTEX)
+	{
+		TimerDuration slice = cfs_timeslice(core, tcb);
+		if (ran < slice)
+			ran = slice;
+	}
+	tcb->vruntime += ran;
+
+	/* The run time is counted; cfs_enqueue() must not count it again */
+	tcb->slice_start = now;
+
+	Spinlock_Lock(&core->rq_spinlock);
+	cfs_update_min_vruntime(core, tcb->vruntime);
+	Spinlock_Unlock(&core->rq_spinlock);
+}
+
+static void cfs_on_tick(CCB *core) {}
+
+static const sched_policy cfs_policy = {
+	.name = "cfs",
+	.enqueue = cfs_enqueue,
+	.dequeue = cfs_dequeue,
+	.pick_next = cfs_pick_next,
+	.on_yield = cfs_on_yield,
+	.on_tick = cfs_on_tick,
+	.timeslice = cfs_timeslice};
+
+/* The available policies; the first one is the default */
+static const sched_policy *const sched_policies[] = {&mlfq_policy, &rr_policy, &cfs_policy, NULL};
+
+/* The current policy */
+static const sched_policy *SCHED = &mlfq_policy;
+
+int sched_select_policy(const char *name)
+{
+	for (const sched_policy *const *p = sched_policies; *p != NULL; p++)
+		if (strcmp((*p)->name, name) == 0)
+		{
+			SCHED = *p;
+			return 0;
+		}
+	return -1;
+}
+
+const char *sched_policy_name()
+{
+	return SCHED->name;
+}
+
+/*
+  Real-time threads.
+
+  The real-time threads of a core are kept in FIFO lists by priority,
+  ahead of the normal threads; a bitmap of the non-empty lists finds the
+  highest priority in O(1). A real-time thread is never demoted. A FIFO 
+  thread runs without a quantum, an RR thread with a QUANTUM.
+
+  In order to compare threads across classes, the rank of a thread is
+  its MLFQ priority for a normal thread, and above all MLFQ priorities
+  for a real-time thread.
+*/
+_Static_assert(MAX_RT_PRIORITY < 32, "rt_bitmap is too narrow");
+
+static inline int is_rt_thread(TCB *tcb)
+{
+	return tcb->sclass != SCHED_CLASS_NORMAL;
+}
+
+static inline int sched_rank(TCB *tcb)
+{
+	return is_rt_thread(tcb) ? PRIORITY_QUEUES + tcb->rt_priority : tcb->priority;
+}
+
+/*
+  Run-queue wait statistics.
+
+  The wait of a thread is measured from the moment it is queued by
+  sched_queue_add() to the start of its timeslice in gain(). Each core
+  keeps the statistics of the threads it runs, by level, and updates
+  them without locking.
+*/
+typedef struct rq_wait_stats
+{
+	unsigned long count, total, max;
+	unsigned long hist[SCHED_HIST_BUCKETS];
+} rq_wait_stats;
+
+static rq_wait_stats rq_waits[MAX_CORES][SCHED_WAIT_LEVELS];
+
+/* The wait statistics level of a thread */
+static inline int sched_wait_level(TCB *tcb)
+{
+	switch (tcb->sclass)
+	{
+	case SCHED_CLASS_FIFO:
+		return PRIORITY_QUEUES + tcb->rt_priority;
+	case SCHED_CLASS_RR:
+		return PRIORITY_QUEUES + MAX_RT_PRIORITY + 1 + tcb->rt_priority;
+	default:
+		return tcb->priority;
+	}
+}
+
+static void sched_record_wait(CCB *core, TCB *tcb, TimerDuration wait)
+{
+	rq_wait_stats *st = &rq_waits[core->id][sched_wait_level(tcb)];
+
+	/* Bucket b > 0 holds waits in [2^(b-1), 2^b) */
+	int b = (wait == 0) ? 0 : 64 - __builtin_clzll(wait);
+	if (b >= SCHED_HIST_BUCKETS)
+		b = SCHED_HIST_BUCKETS - 1;
+
+	st->hist[b]++;
+	st->count++;
+	st->total += wait;
+	if (wait > st->max)
+		st->max = wait;
+}
+
+unsigned long sched_wait_stats(uint core, int level, schedinfo *info)
+{
+	assert(core < MAX_CORES && level >= 0 && level < SCHED_WAIT_LEVELS);
+	rq_wait_stats *st = &rq_waits[core][level];
+
+	info->core = core;
+	if (level < PRIORITY_QUEUES)
+	{
+		info->sclass = SCHED_CLASS_NORMAL;
+		info->priority = level;
+	}
+	else if (level <= PRIORITY_QUEUES + MAX_RT_PRIORITY)
+	{
+		info->sclass = SCHED_CLASS_FIFO;
+		info->priority = level - PRIORITY_QUEUES;
+	}
+	else
+	{
+		info->sclass = SCHED_CLASS_RR;
+		info->priority = level - (PRIORITY_QUEUES + MAX_RT_PRIORITY + 1);
+	}
+
+	info->count = st->count;
+	info->total_usec = st->total;
+	info->max_usec = st->max;
+	for (int b = 0; b < SCHED_HIST_BUCKETS; b++)
+		info->hist[b] = st->hist[b];
+	return info->count;
+}
+
+/*
+  Add TCB to a core's ready queue.
+
+  *** MUST BE CALLED WITH core->rq_spinlock HELD ***
+*/
+static inline void rq_push(CCB *core, TCB *tcb)
+{
+	if (is_rt_thread(tcb))
+	{
+		rlist_push_back(&core->rt_queue[tcb->rt_priority], &tcb->sched_node);
+		core->rt_bitmap |= 1u << tcb->rt_priority;
+	}
+	else
+		SCHED->enqueue(core, tcb);
+	tcb->rq_core = core->id;
+	core->ready_count++;
+}
+
+/*
+  Remove and return the next thread to run from a core's ready queue,
+  or NULL if the queue is empty.
+
+  *** MUST BE CALLED WITH core->rq_spinlock HELD ***
+*/
+static inline TCB *rq_pop(CCB *core)
+{
+	TCB *tcb;
+	if (core->rt_bitmap)
+	{
+		int prio = 31 - __builtin_clz(core->rt_bitmap);
+		tcb = rlist_pop_front(&core->rt_queue[prio])->tcb;
+		if (is_rlist_empty(&core->rt_queue[prio]))
+			core->rt_bitmap &= ~(1u << prio);
+	}
+	else
+		tcb = SCHED->pick_next(core);
 
+	if (tcb != NULL)
+	{
+		tcb->rq_core = NOCORE;
+		core->ready_count--;
+	}
 	return tcb;
 }
 
 /*
-  This is called with sched_spinlock locked !
- */
-void release_TCB(TCB *tcb)
-{
-#ifndef NVALGRIND
-	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
-#endif
+  Remove a queued TCB from the ready queue of its core. Return 0 if tcb
+  was not queued (e.g., it has just been selected by some core).
 
-	free_thread(tcb, THREAD_SIZE);
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static int rq_remove(TCB *tcb)
+{
+	uint c = tcb->rq_core;
+	if (c == NOCORE)
+		return 0;
+
+	CCB *core = &cctx[c];
+	Spinlock_Lock(&core->rq_spinlock);
+	int queued = (tcb->rq_core == c);
+	if (queued)
+	{
+		if (is_rt_thread(tcb))
+		{
+			rlist_remove(&tcb->sched_node);
+			if (is_rlist_empty(&core->rt_queue[tcb->rt_priority]))
+				core->rt_bitmap &= ~(1u << tcb->rt_priority);
+		}
+		else
+			SCHED->dequeue(core, tcb);
+		tcb->rq_core = NOCORE;
+		core->ready_count--;
+	}
+	Spinlock_Unlock(&core->rq_spinlock);
+	return queued;
+}
 
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads--;
-	Mutex_Unlock(&active_threads_spinlock);
+/* The time-slice of a thread */
+static inline TimerDuration sched_timeslice(CCB *core, TCB *tcb)
+{
+	switch (tcb->sclass)
+	{
+	case SCHED_CLASS_FIFO:
+		return 0; /* no quantum */
+	case SCHED_CLASS_RR:
+		return QUANTUM;
+	default:
+		return SCHED->timeslice(core, tcb);
+	}
 }
 
 /*
- *
- * Scheduler
- *
- */
+  Return an idle core (other than 'except'), or -1 if there is none.
+  Only cores that can run in parallel are considered, and the cores in 
+  the 'claimed' mask are not idle (a thread has been queued there). The 
+  search starts after the current core, to spread the load.
+*/
+static int sched_find_idle_core(uint except, uint32_t claimed)
+{
+	uint ncores = cpu_parallel_cores();
+	for (uint i = 1; i <= ncores; i++)
+	{
+		uint c = (cpu_core_id + i) % ncores;
+		if (c != except && cctx[c].curr_priority < 0 && !(claimed & (1u << c)))
+			return c;
+	}
+	return -1;
+}
 
 /*
- *  Note: the scheduler routines are all in the non-preemptive domain.
- */
+  Return the core running the lowest-priority thread. Only cores that 
+  can run in parallel are considered, and core 'c' is preferred on ties.
+*/
+static uint sched_find_lowest_core(uint c)
+{
+	uint ncores = cpu_parallel_cores();
+	for (uint i = 0; i < ncores; i++)
+		if (cctx[i].curr_priority < cctx[c].curr_priority)
+			c = i;
+	return c;
+}
 
-/*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
+_Static_assert(MAX_CORES <= 32, "the claimed core masks are too narrow");
 
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
+/*
+  Choose the core to queue tcb at: the core it last ran on, unless
+  that core is busy with a thread that tcb would not preempt (same or
+  higher priority). In that case, an idle core is chosen if there is 
+  one, else the core running the lowest-priority thread.
 
-  Both of these structures are protected by @c sched_spinlock.
+  The idle cores in the 'claimed' mask are taken to be busy.
 */
+static uint sched_place(TCB *tcb, uint32_t claimed)
+{
+	uint c = tcb->last_core;
+	if (c >= cpu_cores())
+		c = cpu_core_id;
 
-rlnode SCHED[PRIORITY_QUEUES];	   /* The scheduler queue */
-rlnode TIMEOUT_LIST;			   /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
-int count = 0;	/* the counter we use to boost threads */
+	if (cctx[c].curr_priority >= sched_rank(tcb) || (claimed & (1u << c)))
+	{
+		int idle = sched_find_idle_core(c, claimed);
+		if (idle >= 0)
+			c = idle;
+		else
+			c = sched_find_lowest_core(c);
+	}
 
-/* Interrupt handler for ALARM */
-void yield_handler() { yield(SCHED_QUANTUM); }
+	if (c == tcb->last_core)
+		SCHED_STAT_INC(&CURCORE, enq_affine);
+	else
+		SCHED_STAT_INC(&CURCORE, enq_moved);
 
-/* Interrupt handle for inter-core interrupts */
-void ici_handler()
-{ /* noop for now... */
+	return c;
 }
 
 /*
-  Possibly add TCB to the scheduler timeout list.
-
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  Make sure that core c will get to the threads just queued there.
+  If 'preempt' is true, one of them outranks the thread running at c.
 */
-static void sched_register_timeout(TCB *tcb, TimerDuration timeout)
+static void sched_notify_core(uint c, int preempt)
 {
-	if (timeout != NO_TIMEOUT)
+	CCB *core = &cctx[c];
+
+	/* Restart the target core if halted */
+	if (cpu_core_restart(c))
+		return;
+
+	/* An idle core that is polling will find the new threads by itself */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&core->idle_polling, __ATOMIC_SEQ_CST))
+		return;
+
+	/* Ask the target core to reschedule (for the current core, on preempt_on) */
+	if (preempt)
 	{
-		/* set the wakeup time */
-		TimerDuration curtime = bios_clock();
-		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
+		core->preempt_pending = 1;
+		cpu_ici(c);
+		return;
+	}
 
-		/* add to the TIMEOUT_LIST in sorted order */
-		rlnode *n = TIMEOUT_LIST.next;
-		for (; n != &TIMEOUT_LIST; n = n->next)
-			/* skip earlier entries */
-			if (tcb->wakeup_time < n->tcb->wakeup_time)
-				break;
-		/* insert before n */
-		rl_splice(n->prev, &tcb->sched_node);
+	/* The target core now has competition; it needs a quantum timer */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&core->tickless, __ATOMIC_SEQ_CST))
+	{
+		if (c == cpu_core_id)
+			sched_rearm_quantum(core);
+		else
+			cpu_ici(c);
 	}
 }
 
 /*
-  Add TCB to the end of the scheduler list.
+  Add TCB to the end of the ready queue of the core chosen by 
+  sched_place(), and make sure that core will get to it. If tcb 
+  outranks the thread running there, that core is preempted.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  A thread that has just yielded ('yielded' true) does not preempt the
+  current core: it gave the core away, and preempting the thread it 
+  yielded to would only bounce the core back (e.g., a real-time thread
+  spinning on a mutex held by a lower-priority thread).
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
 */
-static void sched_queue_add(TCB *tcb)
+static void sched_queue_add(TCB *tcb, int yielded)
 {
+	uint c = sched_place(tcb, 0);
+	CCB *core = &cctx[c];
+
+	/* Would tcb preempt the thread running at the target core? */
+	int preempt = (core->curr_priority >= 0 && core->curr_priority < sched_rank(tcb)) 
+		&& !(yielded && c == cpu_core_id);
+
+	/* Start measuring the wait of tcb */
+	tcb->ready_time = bios_clock_precise();
+
 	/* Insert at the end of the scheduling list */
-	rlist_push_back(&SCHED[tcb->priority], &tcb->sched_node); // Insert tcb at the end of the queue with its current priority
+	Spinlock_Lock(&core->rq_spinlock);
+	rq_push(core, tcb);
+	Spinlock_Unlock(&core->rq_spinlock);
 
-	/* Restart possibly halted cores */
-	cpu_core_restart_one();
+	sched_notify_core(c, preempt);
 }
 
 /*
-	Adjust the state of a thread to make it READY.
+	Remove a thread from the timer wheel, if it is there.
 
-	*** MUST BE CALLED WITH sched_spinlock HELD ***
+	*** MUST BE CALLED WITH tcb->state_spinlock HELD ***
  */
-static void sched_make_ready(TCB *tcb)
+static void sched_cancel_timeout(TCB *tcb)
 {
-	assert(tcb->state == STOPPED || tcb->state == INIT);
-
-	/* Possibly remove from TIMEOUT_LIST */
 	if (tcb->wakeup_time != NO_TIMEOUT)
 	{
-		/* tcb is in TIMEOUT_LIST, fix it */
+		/* tcb is in a timer wheel, fix it */
 		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
+		CCB *core = &cctx[tcb->timer_core];
+		Spinlock_Lock(&core->timer_spinlock);
 		rlist_remove(&tcb->sched_node);
+		core->timer_count--;
+		Spinlock_Unlock(&core->timer_spinlock);
 		tcb->wakeup_time = NO_TIMEOUT;
 	}
+}
+
+/*
+	Adjust the state of a thread to make it READY.
+
+	*** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+ */
+static void sched_make_ready(TCB *tcb)
+{
+	assert(tcb->state == STOPPED || tcb->state == INIT);
+
+	/* Possibly remove from the timer wheel */
+	sched_cancel_timeout(tcb);
 
 	/* Mark as ready */
 	tcb->state = READY;
 
 	/* Possibly add to the scheduler queue */
 	if (tcb->phase == CTX_CLEAN)
-		sched_queue_add(tcb);
+		sched_queue_add(tcb, 0);
 }
 
 /*
-  Scan the \c TIMEOUT_LIST for threads whose timeout has expired, and
-  wake them up.
+  Scan the timer wheel of the current core for threads whose timeout 
+  has expired, and wake them up.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  Only the slots of the ticks that have passed since the last scan are
+  examined. A slot may also hold threads due in a later revolution of the
+  wheel; these are left in place.
+
+  A thread whose state_spinlock is busy is skipped; it is either being
+  woken up right now, or it will be found expired again, since it is moved
+  to the slot of the current tick.
 */
 static void sched_wakeup_expired_timeouts()
 {
-	/* Empty the timeout list up to the current time and wake up each thread */
+	CCB *core = &CURCORE;
+
+	/* Quick check, without locking */
+	if (core->timer_count == 0)
+		return;
+
 	TimerDuration curtime = bios_clock();
+	TimerDuration now_tick = curtime / TIMER_WHEEL_TICK;
+
+	rlnode expired, busy;
+	rlnode_init(&expired, NULL);
+	rlnode_init(&busy, NULL);
 
-	while (!is_rlist_empty(&TIMEOUT_LIST))
+	Spinlock_Lock(&core->timer_spinlock);
+
+	/* Never scan a slot twice */
+	if (now_tick - core->timer_tick >= TIMER_WHEEL_SLOTS)
+		core->timer_tick = now_tick - (TIMER_WHEEL_SLOTS - 1);
+
+	for (; core->timer_tick <= now_tick; core->timer_tick++)
 	{
-		TCB *tcb = TIMEOUT_LIST.next->tcb;
-		if (tcb->wakeup_time > curtime)
-			break;
+		rlnode *slot = &core->timer_wheel[core->timer_tick % TIMER_WHEEL_SLOTS];
+		rlnode *n = slot->next;
+		while (n != slot)
+		{
+			TCB *tcb = n->tcb;
+			n = n->next;
+
+			if (tcb->wakeup_time > curtime)
+				continue;
+
+			rlist_remove(&tcb->sched_node);
+			if (Spinlock_TryLock(&tcb->state_spinlock))
+			{
+				/* Keep it locked, until it is made ready */
+				core->timer_count--;
+				tcb->wakeup_time = NO_TIMEOUT;
+				rlist_push_back(&expired, &tcb->sched_node);
+			}
+			else
+				rlist_push_back(&busy, &tcb->sched_node);
+		}
+	}
+
+	/* The current tick will be scanned again */
+	core->timer_tick = now_tick;
+	rlist_append(&core->timer_wheel[now_tick % TIMER_WHEEL_SLOTS], &busy);
+
+	Spinlock_Unlock(&core->timer_spinlock);
+
+	/* Wake up the expired threads */
+	while (!is_rlist_empty(&expired))
+	{
+		TCB *tcb = rlist_pop_front(&expired)->tcb;
 		sched_make_ready(tcb);
+		Spinlock_Unlock(&tcb->state_spinlock);
 	}
 }
 
 /*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
+  Return the earliest wakeup time in the timer wheel of a core, or 
+  NO_TIMEOUT if the wheel is empty.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  The slots are scanned in tick order, starting at the current tick; 
+  the first slot that holds a thread due within that tick determines the 
+  result. Threads due in later revolutions of the wheel are only used if 
+  there is no such slot.
 */
-static TCB *sched_queue_select(TCB *current)
+static TimerDuration sched_next_timeout(CCB *core)
 {
-	int i = PRIORITY_QUEUES - 1;
-	/* Searching in queues until we find a non empty one */
-	while (i > 0)
+	TimerDuration deadline = NO_TIMEOUT;
+
+	/* Quick check, without locking */
+	if (core->timer_count == 0)
+		return deadline;
+
+	Spinlock_Lock(&core->timer_spinlock);
+	for (uint i = 0; i < TIMER_WHEEL_SLOTS; i++)
 	{
-		if (is_rlist_empty(&SCHED[i]))
+		TimerDuration tick = core->timer_tick + i;
+		rlnode *slot = &core->timer_wheel[tick % TIMER_WHEEL_SLOTS];
+		int found = 0;
+		for (rlnode *n = slot->next; n != slot; n = n->next)
 		{
-			i--;
+			TimerDuration t = n->tcb->wakeup_time;
+			if (t < deadline)
+				deadline = t;
+			if (t < (tick + 1) * TIMER_WHEEL_TICK)
+				found = 1;
 		}
-		else //found it!
-		{
+		if (found)
 			break;
+	}
+	Spinlock_Unlock(&core->timer_spinlock);
+
+	return deadline;
+}
+
+/*
+  Arm the ALARM timer for the current timeslice of this core.
+
+  If there is no other thread ready at this core, the core goes tickless:
+  the timer is only armed for the next timeout of the core's timer wheel.
+  The tickless flag is set before the ready queue is checked, so that a 
+  concurrent sched_queue_add() either is seen here, or sees the flag and 
+  re-arms the quantum timer.
+*/
+static void sched_arm_timer(CCB *core, TCB *current)
+{
+	__atomic_store_n(&core->tickless, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&core->ready_count, __ATOMIC_SEQ_CST) > 0 && current->rts != 0)
+	{
+		core->tickless = 0;
+		bios_set_timer(current->rts);
+		return;
+	}
+
+	TimerDuration deadline = sched_next_timeout(core);
+	if (deadline != NO_TIMEOUT)
+	{
+		TimerDuration curtime = bios_clock();
+		bios_set_timer((deadline > curtime + TIMER_WHEEL_TICK) ? deadline - curtime : TIMER_WHEEL_TICK);
+	}
+}
+
+/*
+  Steal the highest-priority thread from the ready queue of some other 
+  core. Return NULL if there is nothing to steal.
+*/
+static TCB *sched_steal(CCB *thief)
+{
+	uint ncores = cpu_cores();
+	for (uint i = 1; i < ncores; i++)
+	{
+		CCB *victim = &cctx[(thief->id + i) % ncores];
+
+		/* Quick check, without locking */
+		if (victim->ready_count == 0)
+			continue;
+
+		Spinlock_Lock(&victim->rq_spinlock);
+		TCB *tcb = rq_pop(victim);
+		Spinlock_Unlock(&victim->rq_spinlock);
+
+		if (tcb != NULL)
+		{
+			SCHED_STAT_INC(thief, steals);
+			return tcb;
 		}
 	}
+	return NULL;
+}
+
+/*
+  Select the next thread to run on this core: the head of the local
+  ready queue, or else a thread stolen from another core, or else the
+  current thread (if still READY), or else the idle thread.
+*/
+static TCB *sched_queue_select(TCB *current)
+{
+	CCB *core = &CURCORE;
+	TCB *next_thread = NULL;
 
-	/* Get the head of the SCHED list */
-	rlnode *sel = rlist_pop_front(&SCHED[i]);
+	if (core->ready_count > 0)
+	{
+		Spinlock_Lock(&core->rq_spinlock);
+		next_thread = rq_pop(core);
+		Spinlock_Unlock(&core->rq_spinlock);
+	}
 
-	TCB *next_thread = sel->tcb; /* When the list is empty, this is NULL */
+	if (next_thread == NULL)
+		next_thread = sched_steal(core);
 
 	if (next_thread == NULL)
-		next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
+		next_thread = (current->state == READY) ? current : &core->idle_thread;
 
-	next_thread->its = QUANTUM;
+	next_thread->its = sched_timeslice(core, next_thread);
 
 	return next_thread;
 }
@@ -363,7 +1464,7 @@ int wakeup(TCB *tcb)
 	int oldpre = preempt_off;
 
 	/* To touch tcb->state, we must get the spinlock. */
-	Mutex_Lock(&sched_spinlock);
+	Spinlock_Lock(&tcb->state_spinlock);
 
 	if (tcb->state == STOPPED || tcb->state == INIT)
 	{
@@ -371,7 +1472,7 @@ int wakeup(TCB *tcb)
 		ret = 1;
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	Spinlock_Unlock(&tcb->state_spinlock);
 
 	/* Restore preemption state */
 	if (oldpre)
@@ -380,6 +1481,93 @@ int wakeup(TCB *tcb)
 	return ret;
 }
 
+/*
+  Make many threads ready at once.
+
+  The state spinlocks of all woken threads are held until they are 
+  queued, so that each core's ready queue is locked once for the whole 
+  batch, and each core is notified (restarted, preempted or re-armed) 
+  once. Idle cores are claimed by at most one thread each, so that as 
+  many halted cores are restarted as there are threads to run.
+
+  Holding several state spinlocks is safe by the rule stated at the 
+  top of the scheduler: the only other code holding more than one, 
+  sched_wakeup_expired_timeouts(), takes them with Spinlock_TryLock() 
+  and never waits for one. Thus, this cannot deadlock, as long as the 
+  tcbs are distinct.
+ */
+int wakeup_many(TCB *tcbs[], int n)
+{
+	int woken = 0;
+	rlnode batch[MAX_CORES];
+	uint32_t targets = 0, claimed = 0, preempts = 0;
+
+	/* Preemption off */
+	int oldpre = preempt_off;
+
+	/* Make the threads ready and place them */
+	for (int i = 0; i < n; i++)
+	{
+		TCB *tcb = tcbs[i];
+		Spinlock_Lock(&tcb->state_spinlock);
+
+		if (tcb->state != STOPPED && tcb->state != INIT)
+		{
+			Spinlock_Unlock(&tcb->state_spinlock);
+			tcbs[i] = NULL;
+			continue;
+		}
+
+		sched_cancel_timeout(tcb);
+		tcb->state = READY;
+		woken++;
+
+		/* A thread still switching out is queued by gain() */
+		if (tcb->phase != CTX_CLEAN)
+			continue;
+
+		uint c = sched_place(tcb, claimed);
+		CCB *core = &cctx[c];
+		if (!(targets & (1u << c)))
+			rlnode_init(&batch[c], NULL);
+		targets |= 1u << c;
+		if (core->curr_priority < 0)
+			claimed |= 1u << c;
+		else if (core->curr_priority < sched_rank(tcb))
+			preempts |= 1u << c;
+
+		tcb->ready_time = bios_clock_precise();
+		rlist_push_back(&batch[c], &tcb->sched_node);
+	}
+
+	/* Queue the batch of each target core */
+	for (uint32_t t = targets; t != 0; t &= t - 1)
+	{
+		CCB *core = &cctx[__builtin_ctz(t)];
+		Spinlock_Lock(&core->rq_spinlock);
+		while (!is_rlist_empty(&batch[core->id]))
+			rq_push(core, rlist_pop_front(&batch[core->id])->tcb);
+		Spinlock_Unlock(&core->rq_spinlock);
+	}
+
+	for (int i = 0; i < n; i++)
+		if (tcbs[i] != NULL)
+			Spinlock_Unlock(&tcbs[i]->state_spinlock);
+
+	/* Notify each target core once */
+	for (uint32_t t = targets; t != 0; t &= t - 1)
+	{
+		uint c = __builtin_ctz(t);
+		sched_notify_core(c, (preempts >> c) & 1);
+	}
+
+	/* Restore preemption state */
+	if (oldpre)
+		preempt_on;
+
+	return woken;
+}
+
 /*
   Atomically put the current process to sleep, after unlocking mx.
  */
@@ -390,7 +1578,7 @@ void sleep_releasing(Thread_state state, Mutex *mx, enum SCHED_CAUSE cause,
 
 	int preempt = preempt_off;
 	TCB *tcb = CURTHREAD;
-	Mutex_Lock(&sched_spinlock);
+	Spinlock_Lock(&tcb->state_spinlock);
 
 	/* mark the thread as stopped or exited */
 	tcb->state = state;
@@ -403,8 +1591,8 @@ void sleep_releasing(Thread_state state, Mutex *mx, enum SCHED_CAUSE cause,
 	if (mx != NULL)
 		Mutex_Unlock(mx);
 
-	/* Release the schduler spinlock before calling yield() !!! */
-	Mutex_Unlock(&sched_spinlock);
+	/* Release the thread spinlock before calling yield() !!! */
+	Spinlock_Unlock(&tcb->state_spinlock);
 
 	/* call this to schedule someone else */
 	yield(cause);
@@ -414,9 +1602,101 @@ void sleep_releasing(Thread_state state, Mutex *mx, enum SCHED_CAUSE cause,
 		preempt_on;
 }
 
+int sched_set_param(TCB *tcb, sched_class sclass, int prio)
+{
+	int preempt = preempt_off;
+	Spinlock_Lock(&tcb->state_spinlock);
+
+	int old_rank = sched_rank(tcb);
+	int requeue = rq_remove(tcb);
+
+	tcb->sclass = sclass;
+	tcb->rt_priority = prio;
+	if (!is_rt_thread(tcb) && old_rank >= PRIORITY_QUEUES)
+		tcb->priority = PRIORITY_QUEUES - 1; /* from real-time, start at the top MLFQ level */
+
+	if (requeue)
+		sched_queue_add(tcb, 0);
+
+	int demoted = (tcb == CURTHREAD && sched_rank(tcb) < old_rank);
+	if (tcb == CURTHREAD)
+		CURCORE.curr_priority = sched_rank(tcb);
+
+	Spinlock_Unlock(&tcb->state_spinlock);
+
+	if (preempt)
+		preempt_on;
+	return demoted;
+}
+
+static void sched_yield(enum SCHED_CAUSE cause, TCB *next); /* forward */
+
+/*
+  Directed yield.
+
+  A thread kept for a handoff is READY, but in no ready queue, so that no
+  other core can run it; it is run by the thread that kept it, which hands
+  it its core.
+
+  A real-time thread does not hand its core to a thread of lower rank,
+  since that would run it ahead of the real-time threads queued here.
+*/
+static inline int sched_can_handoff(TCB *current, TCB *tcb)
+{
+	return tcb != current && tcb->type == NORMAL_THREAD &&
+		   (!is_rt_thread(current) || sched_rank(tcb) >= sched_rank(current));
+}
+
+void handoff(TCB *tcb)
+{
+	assert(tcb->state == READY && tcb->rq_core == NOCORE);
+	int preempt = preempt_off;
+	sched_yield(SCHED_USER, tcb);
+	if (preempt)
+		preempt_on;
+}
+
+int wakeup_handoff(TCB *tcb)
+{
+	int ret = 0;
+	int preempt = preempt_off;
+
+	Spinlock_Lock(&tcb->state_spinlock);
+	if (tcb->state == STOPPED || tcb->state == INIT)
+	{
+		/* A thread still switching out at some core cannot be run here yet */
+		if (tcb->phase == CTX_CLEAN && sched_can_handoff(CURTHREAD, tcb))
+		{
+			sched_cancel_timeout(tcb);
+			tcb->state = READY;
+			tcb->ready_time = bios_clock_precise();
+			ret = 2;
+		}
+		else
+		{
+			sched_make_ready(tcb);
+			ret = 1;
+		}
+	}
+	Spinlock_Unlock(&tcb->state_spinlock);
+
+	if (preempt)
+		preempt_on;
+	return ret;
+}
+
 /* This function is the entry point to the scheduler's context switching */
 
 void yield(enum SCHED_CAUSE cause)
+{
+	sched_yield(cause, NULL);
+}
+
+/*
+  Reschedule the current core. The next thread is 'next', if not NULL,
+  else it is selected from the ready queues.
+*/
+static void sched_yield(enum SCHED_CAUSE cause, TCB *next)
 {
 	/* Reset the timer, so that we are not interrupted by ALARM */
 	TimerDuration remaining = bios_cancel_timer();
@@ -424,83 +1704,44 @@ void yield(enum SCHED_CAUSE cause)
 	/* We must stop preemption but save it! */
 	int preempt = preempt_off;
 
-	TCB *current = CURTHREAD; /* Make a local copy of current process, for speed */
+	CCB *core = &CURCORE;
+	TCB *current = core->current_thread; /* Make a local copy of current process, for speed */
 
-	Mutex_Lock(&sched_spinlock);
-
-	/* After we MAX_CALLS calls of yield(), we boost every thread by 1 */
-	if (count < MAX_CALLS)
-	{
-		count++;
-	}
-	else	// we have reached MAX_CALLS
-	{
-		/*Increasing the priority of each queue one by one*/
-		rlnode *temp = NULL;	//temporary "queue" (node)
-		for (int i = PRIORITY_QUEUES - 1; i >= 0; i--)
-		{
-			temp = SCHED[i].node;	//  pointer to the i node
-			while (temp != NULL)	// checking if node is not null
-			{
-				temp->tcb->priority++;
-				temp = temp->next;
-			}
-		}
-		count = 0;
-	}
+	/* Let the policy account for this reschedule */
+	SCHED->on_tick(core);
 
 	/* Update CURTHREAD state */
+	Spinlock_Lock(&current->state_spinlock);
 	if (current->state == RUNNING)
 		current->state = READY;
+	Spinlock_Unlock(&current->state_spinlock);
 
 	/* Update CURTHREAD scheduler data */
 	current->rts = remaining;
 	current->last_cause = current->curr_cause;
 	current->curr_cause = cause;
 
-	/* Case 2: SCHED_QUANTUM - Thread quantum has expired */
-	if (current->curr_cause == SCHED_QUANTUM)	// thread use the quantum and has not completed its job
-	{
-		if (current->priority > 0)
-		{
-			current->priority--;
-		}
-	}
-
-	/* Case 3: SCHEND_IO - Interactive thread (I/O) */
-	if (current->curr_cause == SCHED_IO)	// thread uses I/O but the quantum has passed
-	{
-		if (current->priority < PRIORITY_QUEUES - 1)
-		{
-			current->priority++;
-		}
-	}
-
-	/* Case 4: SCHED_MUTEX - Priority inversion */
-	if (current->curr_cause == current->last_cause && current->last_cause == SCHED_MUTEX)	// mutex is locked by a lower priority thread
-	{
-		if (current->priority > 0)
-		{
-			current->priority--;
-		}
-	}
+	/* Let the policy adjust the thread's priority */
+	if (!is_rt_thread(current))
+		SCHED->on_yield(core, current, cause);
 
 	/* Wake up threads whose sleep timeout has expired */
 	sched_wakeup_expired_timeouts();
 
-	/* Get next */
-	TCB *next = sched_queue_select(current);
+	/* Get next, unless it was handed the core */
+	if (next == NULL)
+		next = sched_queue_select(current);
+	else
+		next->its = sched_timeslice(core, next);
 	assert(next != NULL);
 
 	/* Save the current TCB for the gain phase */
-	CURCORE.previous_thread = current;
-
-	Mutex_Unlock(&sched_spinlock);
+	core->previous_thread = current;
 
 	/* Switch contexts */
 	if (current != next)
 	{
-		CURTHREAD = next;
+		core->current_thread = next;
 		cpu_swap_context(&current->context, &next->context);
 	}
 
@@ -524,55 +1765,128 @@ void yield(enum SCHED_CAUSE cause)
 
 void gain(int preempt)
 {
-	Mutex_Lock(&sched_spinlock);
+	CCB *core = &CURCORE;
+	TCB *current = core->current_thread;
 
-	TCB *current = CURTHREAD;
+	/* Any pending preemption request is served by this reschedule */
+	core->preempt_pending = 0;
 
 	/* Mark current state */
+	Spinlock_Lock(&current->state_spinlock);
 	current->state = RUNNING;
 	current->phase = CTX_DIRTY;
 	current->rts = current->its;
+	current->slice_start = bios_clock_precise();
+	if (current->ready_time != 0)
+	{
+		sched_record_wait(core, current, current->slice_start - current->ready_time);
+		current->ready_time = 0;
+	}
+	if (current->last_core != core->id)
+		SCHED_STAT_INC(core, migrations);
+	current->last_core = core->id;
+	Spinlock_Unlock(&current->state_spinlock);
+	core->curr_priority = (current->type == IDLE_THREAD) ? -1 : sched_rank(current);
 
 	/* Take care of the previous thread */
-	TCB *prev = CURCORE.previous_thread;
+	TCB *prev = core->previous_thread;
 	if (current != prev)
 	{
+		Spinlock_Lock(&prev->state_spinlock);
 		prev->phase = CTX_CLEAN;
-		switch (prev->state)
+		Thread_state prev_state = prev->state;
+		switch (prev_state)
 		{
 		case READY:
 			if (prev->type != IDLE_THREAD)
-				sched_queue_add(prev);
+				sched_queue_add(prev, 1);
 			break;
 		case EXITED:
-			release_TCB(prev);
-			break;
 		case STOPPED:
 			break;
 		default:
 			assert(0); /* prev->state should not be INIT or RUNNING ! */
 		}
+		Spinlock_Unlock(&prev->state_spinlock);
+
+		/* An exited thread is not touched by anyone else */
+		if (prev_state == EXITED)
+		{
+			defer_release_TCB(core, prev);
+			if (core->dead_count >= TCB_REAP_BATCH)
+				reap_threads(core);
+		}
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	/* Set a 1-quantum alarm, unless there is no competition */
+	sched_arm_timer(core, current);
 
 	/* Reset preemption as needed */
 	if (preempt)
 		preempt_on;
+}
 
-	/* Set a 1-quantum alarm */
-	bios_set_timer(current->rts);
+/*
+  Adaptive polling before halting.
+
+  Halting a core and restarting it costs a signal round-trip. When work
+  arrives soon after a core becomes idle (e.g., a pipe producer and 
+  consumer on different cores), it is cheaper to poll the ready queue 
+  for a while. The polling window is twice the moving average of recent
+  idle periods, and no polling is done if that is longer than 
+  IDLE_POLL_MAX. Polling is only done when the cores really run in 
+  parallel; else, it would take the CPU away from the other cores.
+*/
+#define IDLE_POLL_MAX 100 /* usec */
+
+/* Poll the ready queue of this core; return 1 if a thread arrived */
+static int sched_idle_poll(CCB *core, TimerDuration start)
+{
+	TimerDuration window = 2 * core->idle_avg;
+	if (window == 0 || window > IDLE_POLL_MAX || cpu_parallel_cores() < 2)
+		return 0;
+
+	/* While idle_polling is set, sched_notify_core() leaves the core alone */
+	__atomic_store_n(&core->idle_polling, 1, __ATOMIC_SEQ_CST);
+	while (core->ready_count == 0 && bios_clock_precise() - start < window)
+	{
+#if defined(__x86__) || defined(__x86_64__)
+		__builtin_ia32_pause();
+#endif
+	}
+	__atomic_store_n(&core->idle_polling, 0, __ATOMIC_SEQ_CST);
+
+	/* A thread queued while we stopped polling is seen here */
+	return __atomic_load_n(&core->ready_count, __ATOMIC_SEQ_CST) > 0;
 }
 
 static void idle_thread()
 {
+	CCB *core = &CURCORE;
+
 	/* When we first start the idle thread */
 	yield(SCHED_IDLE);
 
 	/* We come here whenever we cannot find a ready thread for our core */
 	while (active_threads > 0)
 	{
-		cpu_core_halt();
+		/* Nothing else to do, release the exited threads */
+		if (core->dead_count > 0)
+		{
+			int preempt = preempt_off;
+			reap_threads(core);
+			if (preempt)
+				preempt_on;
+		}
+
+		TimerDuration start = bios_clock_precise();
+		if (!sched_idle_poll(core, start))
+			cpu_core_halt();
+
+		/* Update the average idle period, with weight 1/8 */
+		TimerDuration idle = bios_clock_precise() - start;
+		core->idle_avg = (7 * core->idle_avg + idle) / 8;
+
 		yield(SCHED_IDLE);
 	}
 
@@ -582,15 +1896,52 @@ static void idle_thread()
 }
 
 /*
-  Initialize the scheduler queue
+  Initialize the scheduler queues
  */
 void initialize_scheduler()
 {
-	for (int i = 0; i < PRIORITY_QUEUES; i++)
+	for (uint c = 0; c < MAX_CORES; c++)
 	{
-		rlnode_init(&SCHED[i], NULL);
+		CCB *core = &cctx[c];
+		core->rq_spinlock = SPINLOCK_INIT;
+		for (int i = 0; i < RQ_SLOTS; i++)
+			rlnode_init(&core->ready_queue[i], NULL);
+		core->ready_bitmap = 0;
+		core->epoch = 0;
+		for (int i = 0; i <= MAX_RT_PRIORITY; i++)
+			rlnode_init(&core->rt_queue[i], NULL);
+		core->rt_bitmap = 0;
+		avltree_init(&core->cfs_tree);
+		core->min_vruntime = 0;
+		core->ready_count = 0;
+		core->yield_count = 0;
+
+		core->timer_spinlock = SPINLOCK_INIT;
+		for (int i = 0; i < TIMER_WHEEL_SLOTS; i++)
+			rlnode_init(&core->timer_wheel[i], NULL);
+		core->timer_tick = bios_clock() / TIMER_WHEEL_TICK;
+		core->timer_count = 0;
+
+		core->current_thread = NULL;
+		core->tickless = 0;
+		core->curr_priority = -1;
+		core->preempt_pending = 0;
+		core->idle_polling = 0;
+		core->idle_avg = 0;
+		for (int k = 0; k < TCB_CLASSES; k++)
+		{
+			core->tcb_cache[k] = NULL;
+			core->tcb_cache_count[k] = 0;
+		}
+		rlnode_init(&core->dead_list, NULL);
+		core->dead_count = 0;
+
+#if defined(SCHED_STATISTICS)
+		core->enq_affine = core->enq_moved = 0;
+		core->migrations = core->steals = 0;
+		core->tcb_cache_hits = core->tcb_cache_misses = 0;
+#endif
 	}
-	rlnode_init(&TIMEOUT_LIST, NULL);
 }
 
 void run_scheduler()
@@ -606,7 +1957,16 @@ void run_scheduler()
 	curcore->idle_thread.type = IDLE_THREAD;
 	curcore->idle_thread.state = RUNNING;
 	curcore->idle_thread.phase = CTX_DIRTY;
+	curcore->idle_thread.state_spinlock = SPINLOCK_INIT;
+	curcore->idle_thread.priority = 0;
+	curcore->idle_thread.rq_core = NOCORE;
+	curcore->idle_thread.ready_time = 0;
+	curcore->idle_thread.sclass = SCHED_CLASS_NORMAL;
+	curcore->idle_thread.rt_priority = 0;
+	curcore->idle_thread.last_core = cpu_core_id;
 	curcore->idle_thread.wakeup_time = NO_TIMEOUT;
+	curcore->idle_thread.vruntime = 0;
+	curcore->idle_thread.vruntime_core = cpu_core_id;
 	rlnode_init(&curcore->idle_thread.sched_node, &curcore->idle_thread);
 
 	curcore->idle_thread.its = QUANTUM;
@@ -627,4 +1987,27 @@ void run_scheduler()
 	assert(CURTHREAD == &CURCORE.idle_thread);
 	cpu_interrupt_handler(ALARM, NULL);
 	cpu_interrupt_handler(ICI, NULL);
+	preempt_off;
+
+	/* Release the exited threads and the cached thread blocks */
+	reap_threads(curcore);
+	for (int k = 0; k < TCB_CLASSES; k++)
+	{
+		tcb_free_list(curcore->tcb_cache[k], k);
+		curcore->tcb_cache[k] = NULL;
+		curcore->tcb_cache_count[k] = 0;
+		Spinlock_Lock(&tcb_pool[k].lock);
+		tcb_free_list(tcb_pool[k].head, k);
+		tcb_pool[k].head = NULL;
+		tcb_pool[k].count = 0;
+		Spinlock_Unlock(&tcb_pool[k].lock);
+	}
+
+#if defined(SCHED_STATISTICS)
+	fprintf(stderr, "Core %3u: enq affine=%tu moved=%tu  migrations=%tu  steals=%tu\n",
+			curcore->id, curcore->enq_affine, curcore->enq_moved,
+			curcore->migrations, curcore->steals);
+	fprintf(stderr, "Core %3u: thread block cache hits=%tu misses=%tu\n",
+			curcore->id, curcore->tcb_cache_hits, curcore->tcb_cache_misses);
+#endif
 }
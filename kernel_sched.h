@@ -24,6 +24,56 @@
 #include "tinyos.h"
 #include "util.h"
 
+/* Define to collect (and print at shutdown) per-core scheduler statistics */
+#if 0
+#define SCHED_STATISTICS
+#endif
+
+/*****************************
+ *
+ *  Spinlocks
+ *
+ *****************************/
+
+/**
+  @brief A FIFO spinlock, for the internal locks of the scheduler.
+
+  This is a ticket lock: each locker takes the next ticket and waits until
+  its ticket is served. Unlike @c Mutex, the lock is granted in the order
+  it was requested, and a waiter only reads the lock while it spins, so
+  the lock's cache line is not fought over by the waiting cores.
+
+  It is declared here rather than in kernel_cc.h, because the TCB and CCB
+  use it; it is implemented in kernel_cc.c.
+
+  @see Spinlock_Lock
+*/
+typedef struct spinlock {
+	unsigned short next;  /**< @brief The next ticket to issue */
+	unsigned short owner; /**< @brief The ticket being served */
+} Spinlock;
+
+/** @brief The initializer for @c Spinlock */
+#define SPINLOCK_INIT ((Spinlock){0, 0})
+
+/**
+  @brief Lock a spinlock.
+
+  Unlike @c Mutex_Lock, this must be called with preemption off, and 
+  preemption must stay off until @c Spinlock_Unlock. A waiter that was 
+  preempted while holding a ticket would stall every waiter behind it.
+*/
+void Spinlock_Lock(Spinlock *lock);
+
+/**
+  @brief Try to lock a spinlock, without waiting.
+  @returns 1 if the lock was taken by this call, 0 if it was busy.
+*/
+int Spinlock_TryLock(Spinlock *lock);
+
+/** @brief Unlock a spinlock. */
+void Spinlock_Unlock(Spinlock *lock);
+
 /*****************************
  *
  *  The Thread Control Block
@@ -88,7 +138,8 @@ enum SCHED_CAUSE {
 	SCHED_PIPE, /**< @brief Sleep at a pipe or socket */
 	SCHED_POLL, /**< @brief The thread is polling a device */
 	SCHED_IDLE, /**< @brief The idle thread called yield */
-	SCHED_USER /**< @brief User-space code called yield */
+	SCHED_USER, /**< @brief User-space code called yield */
+	SCHED_PREEMPT /**< @brief Another core asked for a higher-priority thread to run here */
 };
 
 /**
@@ -104,20 +155,37 @@ typedef struct thread_control_block {
 	PTCB* ptcb;	/**< @brief Pointer used for connecting a TCB to a PTCB */
 
 	cpu_context_t context; /**< @brief The thread context */
+	size_t stack_size; /**< @brief The size of the thread stack */
 
 	Thread_type type; /**< @brief The type of thread */
 	Thread_state state; /**< @brief The state of the thread */
 	Thread_phase phase; /**< @brief The phase of the thread */
 
+	Spinlock state_spinlock; /**< @brief Protects @c state, @c phase and @c wakeup_time */
+
   int priority; /**< @brief The tcb priority for MLFQ */
+	uint rq_epoch; /**< @brief The ready queue epoch when this thread was queued */
+	volatile uint rq_core; /**< @brief The core whose ready queue holds this thread, or @c NOCORE */
+
+	sched_class sclass; /**< @brief The scheduling class of this thread */
+	int rt_priority; /**< @brief The priority of a real-time thread */
+
+	uint last_core; /**< @brief The core this thread last ran on (or was created on) */
 
 	void (*thread_func)(); /**< @brief The initial function executed by this thread */
 
 	TimerDuration wakeup_time; /**< @brief The time this thread will be woken up by the scheduler */
+	uint timer_core; /**< @brief The core whose timer wheel holds this thread, if @c wakeup_time is set */
 
 	rlnode sched_node; /**< @brief Node to use when queueing in the scheduler queue */
 	TimerDuration its; /**< @brief Initial time-slice for this thread */
 	TimerDuration rts; /**< @brief Remaining time-slice for this thread */
+	TimerDuration slice_start; /**< @brief Start of the current time-slice, by @c bios_clock_precise() */
+	TimerDuration ready_time; /**< @brief When the thread was last queued, by @c bios_clock_precise(), or 0 */
+
+	TimerDuration vruntime; /**< @brief Virtual run time, for the CFS policy */
+	uint vruntime_core; /**< @brief The core whose @c min_vruntime @c vruntime is relative to */
+	avlnode cfs_node; /**< @brief Node to use when queueing in a CFS tree */
 
 	enum SCHED_CAUSE curr_cause; /**< @brief The endcause for the current time-slice */
 	enum SCHED_CAUSE last_cause; /**< @brief The endcause for the last time-slice */
@@ -141,15 +209,69 @@ typedef struct thread_control_block {
  */
 #define THREAD_STACK_SIZE (128 * 1024)
 
+/** @brief The smallest thread stack size.
+
+  Smaller requested stack sizes are rounded up to this.
+ */
+#define THREAD_MIN_STACK_SIZE (16 * 1024)
+
+/** @brief The largest thread stack size. */
+#define THREAD_MAX_STACK_SIZE (64 * 1024 * 1024)
+
+/** @brief The number of stack size classes of cached thread blocks */
+#define TCB_CLASSES 2
+
 /************************
  *
  *      Scheduler
  *
  ************************/
 
+/** @brief Number of MLFQ priority levels.
+
+  Level @c PRIORITY_QUEUES-1 is the highest priority.
+ */
+#define PRIORITY_QUEUES (MAX_NORMAL_PRIORITY + 1)
+
+/** @brief Number of lists in the ready queue ring of a core.
+
+  This must be a power of 2, larger than @c PRIORITY_QUEUES and
+  at most 64 (the width of @c CCB.ready_bitmap).
+ */
+#define RQ_SLOTS 64
+
+/** @brief Number of slots in the timer wheel of a core. Must be a power of 2. */
+#define TIMER_WHEEL_SLOTS 256
+
+/** @brief The time span (in usec) covered by each slot of a timer wheel. */
+#define TIMER_WHEEL_TICK 1000
+
+/** @brief A core id denoting no core. */
+#define NOCORE ((uint)-1)
+
 /** @brief Core control block.
 
   Per-core info in memory (basically scheduler-related). 
+
+  Each core owns its own ready queue, protected by its own @c rq_spinlock.
+  Real-time threads are queued in FIFO lists by priority, ahead of the 
+  normal threads, which are ordered by the scheduler policy.
+  A thread is normally queued at the core it last ran on, whose cache is
+  most likely to hold its data. If that core is busy with a thread of the 
+  same or higher priority, the thread is queued at an idle core instead,
+  or else at the core running the lowest-priority thread, which is then 
+  preempted by an inter-core interrupt. A core whose queue is empty steals 
+  work from the queues of other cores.
+
+  Each core also owns a hashed timer wheel, holding the threads that went 
+  to sleep with a timeout on this core. A thread whose wakeup time falls 
+  in tick @c t is kept (unsorted) at slot @c t%TIMER_WHEEL_SLOTS, so that
+  registering and cancelling a timeout is O(1).
+
+  A thread that runs with no competition at its core runs tickless: 
+  the ALARM timer is only armed for the next timeout of the core's 
+  timer wheel (if any). The quantum timer is re-armed when some other
+  thread becomes ready at the core.
  */
 typedef struct core_control_block {
 	uint id; /**< @brief The core id */
@@ -158,6 +280,46 @@ typedef struct core_control_block {
 	TCB* previous_thread; /**< @brief Points to the thread that previously owned the core */
 	TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
 
+	Spinlock rq_spinlock; /**< @brief Protects the ready queue of this core */
+	rlnode rt_queue[MAX_RT_PRIORITY + 1]; /**< @brief The real-time threads of this core, by priority */
+	uint32_t rt_bitmap; /**< @brief Bit @c p is set iff @c rt_queue[p] is non-empty */
+	rlnode ready_queue[RQ_SLOTS]; /**< @brief The MLFQ lists of this core, as a ring indexed by level minus @c epoch */
+	uint64_t ready_bitmap; /**< @brief Bit @c s is set iff @c ready_queue[s] is non-empty */
+	uint epoch; /**< @brief Aging epoch; every increment raises all queued threads by one level */
+	avltree cfs_tree; /**< @brief The ready threads of this core, by vruntime (CFS policy) */
+	TimerDuration min_vruntime; /**< @brief Monotonic lower bound of the vruntime of ready threads (CFS policy) */
+	volatile uint ready_count; /**< @brief The number of threads in the ready queue */
+	uint yield_count; /**< @brief Calls to yield() since the last epoch increment */
+
+	Spinlock timer_spinlock; /**< @brief Protects the timer wheel of this core */
+	rlnode timer_wheel[TIMER_WHEEL_SLOTS]; /**< @brief The timer wheel of this core */
+	TimerDuration timer_tick; /**< @brief The earliest tick not yet fully expired */
+	volatile uint timer_count; /**< @brief The number of threads in @c timer_wheel */
+
+	volatile int tickless; /**< @brief Set when the quantum timer of the current thread is not armed */
+
+	volatile int curr_priority; /**< @brief The priority of @c current_thread, or -1 for the idle thread */
+	volatile int preempt_pending; /**< @brief Set (before an ICI) to ask this core to reschedule */
+
+	volatile int idle_polling; /**< @brief Set while the idle thread polls the ready queue, before halting */
+	TimerDuration idle_avg; /**< @brief Moving average of the idle periods of this core, in usec */
+
+	struct thread_block* tcb_cache[TCB_CLASSES]; /**< @brief Free thread blocks (TCB and stack) of this core, by stack size class */
+	uint tcb_cache_count[TCB_CLASSES]; /**< @brief The lengths of the @c tcb_cache lists */
+
+	rlnode dead_list; /**< @brief Exited threads of this core, whose thread blocks are not yet released */
+	uint dead_count; /**< @brief The length of @c dead_list */
+
+#if defined(SCHED_STATISTICS)
+	/* Statistics, updated by the core itself */
+	uintptr_t enq_affine; /**< @brief Threads queued by this core at their last core */
+	uintptr_t enq_moved; /**< @brief Threads queued by this core away from their last core */
+	uintptr_t migrations; /**< @brief Threads that started a timeslice here, having last run elsewhere */
+	uintptr_t steals; /**< @brief Threads stolen by this core from other cores */
+	uintptr_t tcb_cache_hits; /**< @brief Thread blocks allocated by this core from the cache */
+	uintptr_t tcb_cache_misses; /**< @brief Thread blocks allocated by this core from the host */
+#endif
+
 } CCB;
 
 /** @brief the array of Core Control Blocks (CCB) for the kernel */
@@ -207,6 +369,20 @@ TCB* cur_thread();
 */
 TCB* spawn_thread(PCB* pcb, void (*func)());
 
+/**
+  @brief Create a new thread with a given stack size.
+
+  This is like @c spawn_thread(), but the thread stack has at least
+  @c stack_size bytes (and at least @c THREAD_MIN_STACK_SIZE).
+
+  @param pcb the new thread's owner process
+  @param func the function to execute in the new thread
+  @param stack_size the requested stack size, at most @c THREAD_MAX_STACK_SIZE
+  @returns  A pointer to the TCB of the new thread, in the @c INIT state.
+  @see spawn_thread
+*/
+TCB* spawn_thread_stack(PCB* pcb, void (*func)(), size_t stack_size);
+
 /**
   @brief Wakeup a blocked thread.
 
@@ -219,6 +395,22 @@ TCB* spawn_thread(PCB* pcb, void (*func)());
 */
 int wakeup(TCB* tcb);
 
+/**
+  @brief Wakeup many blocked threads at once.
+
+  This is equivalent to calling @c wakeup() on each thread, but the ready
+  queue of each core is locked once, and each core is restarted or 
+  interrupted at most once, for the whole batch. The state spinlocks of
+  the woken threads are all held during the call, so @c n should be small.
+
+  @param tcbs the distinct threads to be made @c READY. On return, the 
+     threads that were not @c STOPPED or @c INIT are replaced by @c NULL.
+  @param n the number of threads
+  @returns the number of threads made @c READY
+  @see wakeup
+*/
+int wakeup_many(TCB* tcbs[], int n);
+
 /** 
   @brief Block the current thread.
 
@@ -260,6 +452,35 @@ void sleep_releasing(Thread_state newstate, Mutex* mx, enum SCHED_CAUSE cause, T
  */
 void yield(enum SCHED_CAUSE cause);
 
+/**
+  @brief Wake up a thread, keeping it for a handoff.
+
+  This is like @c wakeup(), but instead of being queued, the woken thread
+  may be kept out of the ready queues, for the current thread to switch 
+  to it directly by @c handoff(). This saves the queueing, and possibly 
+  the restart of a halted core, when the woken thread is about to consume
+  data that the current thread has just produced.
+
+  A thread that is still switching out at another core, or that is of
+  lower priority than the current real-time thread, is woken up as by
+  @c wakeup().
+
+  @param tcb the thread to wake up
+  @returns 0 if @c tcb was not sleeping, 1 if it was woken up and queued, 
+    and 2 if it was woken up and kept. In the last case, the caller 
+    must call @c handoff(tcb) without sleeping in between.
+  @see handoff
+ */
+int wakeup_handoff(TCB* tcb);
+
+/**
+  @brief Switch the current core to a thread kept by @c wakeup_handoff().
+
+  The current thread stays ready, as after @c yield(), and is queued
+  again.
+ */
+void handoff(TCB* tcb);
+
 /**
   @brief Enter the scheduler.
 
@@ -276,6 +497,94 @@ void run_scheduler(void);
  */
 void initialize_scheduler(void);
 
+/**
+  @brief Set the scheduling class and real-time priority of a thread.
+
+  A queued thread is moved to the queue of its new class and priority. 
+  If the current thread lowers its own priority, it should yield, so 
+  that any thread that now outranks it can run. This is left to the 
+  caller, which must first release any lock that such a thread may need.
+
+  @param tcb the thread, which must not have exited
+  @param sclass the new class
+  @param prio the new real-time priority (0 for the normal class)
+  @returns 1 if @c tcb is the current thread and it was demoted, else 0
+  @see SetSchedParam
+ */
+int sched_set_param(TCB* tcb, sched_class sclass, int prio);
+
+/** @brief The number of levels with separate run-queue wait statistics.
+
+  These are the @c PRIORITY_QUEUES levels of normal threads, followed by
+  the priorities of @c SCHED_CLASS_FIFO and then of @c SCHED_CLASS_RR.
+ */
+#define SCHED_WAIT_LEVELS (PRIORITY_QUEUES + 2 * (MAX_RT_PRIORITY + 1))
+
+/**
+  @brief Get the run-queue wait statistics of a core at some level.
+
+  The statistics are read without locking, while the core may be 
+  updating them.
+
+  @param core the core
+  @param level the level, in @c 0..SCHED_WAIT_LEVELS-1
+  @param info the statistics are stored here
+  @returns the number of waits recorded, i.e., @c info->count
+  @see OpenSchedInfo
+ */
+unsigned long sched_wait_stats(uint core, int level, schedinfo* info);
+
+/**
+  @brief Select the scheduler policy.
+
+  The policy decides the order in which the ready threads of each core
+  are run. The available policies are
+  - @c "mlfq", a multi-level feedback queue (the default),
+  - @c "rr", plain round-robin, and
+  - @c "cfs", completely fair scheduling by virtual run time.
+
+  This function must be called before the scheduler is initialized.
+  The @c boot() call selects the policy named by the environment variable 
+  @c TINYOS_SCHED, if set.
+
+  @param name the name of the policy
+  @returns 0 on success, or -1 if there is no policy by this name
+ */
+int sched_select_policy(const char* name);
+
+/**
+  @brief Return the name of the current scheduler policy.
+ */
+const char* sched_policy_name(void);
+
+/**
+  @brief Enable or disable stack painting.
+
+  When enabled, the stack of every new thread is painted with a pattern,
+  so that @c thread_stack_depth() can measure how deep it got. This costs
+  the full stack size in memory per thread, and is meant for choosing 
+  stack sizes.
+
+  This function must be called before the scheduler is initialized.
+  The @c boot() call enables painting if the environment variable
+  @c TINYOS_STACKPAINT is set.
+ */
+void sched_set_stack_paint(int enable);
+
+/**
+  @brief Return non-zero if stack painting is enabled.
+ */
+int sched_stack_paint_enabled(void);
+
+/**
+  @brief Return the maximum depth reached by the stack of a thread, in bytes.
+
+  @param tcb a thread created by @c spawn_thread_stack()
+  @returns the depth, or 0 if stack painting is not enabled
+  @see sched_set_stack_paint
+ */
+size_t thread_stack_depth(TCB* tcb);
+
 /**
   @brief Quantum (in microseconds) 
 
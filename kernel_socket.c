@@ -5,6 +5,7 @@
 #include "kernel_streams.h"
 #include "kernel_cc.h"
 #include "kernel_sched.h"
+#include "kernel_proc.h"
 #include "stddef.h"
 #include "stdio.h"
 
@@ -18,6 +19,33 @@ static file_ops socket_file_ops = {
 	.Write = socket_write,
 	.Close = socket_close};
 
+/*
+  Protects PORT_MAP, the types of the sockets and the queues of the
+  listeners. Reads and writes on a peer socket only take the lock of 
+  its pipe.
+*/
+static Mutex port_map_lock = MUTEX_INIT;
+
+/*
+  Get the SCB of a socket fid of the current process, or NULL. On success,
+  the FCB of the socket is returned in *fcbp with a reference, so that the
+  socket cannot be closed by another thread; the caller must release it by
+  FCB_decref(), without holding port_map_lock.
+*/
+static SCB *get_scb(Fid_t sock, FCB **fcbp)
+{
+	FCB *fcb = get_fcb_ref(sock);
+	if (fcb == NULL)
+		return NULL;
+	if (fcb->streamfunc != &socket_file_ops)
+	{
+		FCB_decref(fcb);
+		return NULL;
+	}
+	*fcbp = fcb;
+	return fcb->streamobj;
+}
+
 int socket_read(void *socket_cb, char *buf, unsigned int size)
 {
 	// Check if SCB is valid
@@ -93,6 +121,8 @@ int socket_close(void *socket_cb)
 	// Cast SCB to the appropriate type
 	SCB *scb = (SCB *)socket_cb;
 
+	Mutex_Lock(&port_map_lock);
+
 	// Clear the stream object
 	scb->fcb->streamobj = NULL;
 
@@ -129,9 +159,26 @@ int socket_close(void *socket_cb)
 		break;
 	}
 
+	Mutex_Unlock(&port_map_lock);
 	return 0;
 }
 
+/*
+  Make a new unbound socket the stream of a reserved FCB.
+*/
+static SCB *socket_open(FCB *fcb, port_t port)
+{
+	SCB *scb = (SCB *)xmalloc(sizeof(SCB));											 // Allocate memory for the socket control block
+	scb->refcount = 1;																 // Set the reference count to 1
+	scb->fcb = fcb;																	 // Set the file control block
+	scb->type = SOCKET_UNBOUND;														 // Set the socket type to unbound
+	scb->port = port;																 // Set the port number
+	scb->socket_union.unbound_s = (unbound_socket *)xmalloc(sizeof(unbound_socket)); // Allocate memory for the unbound socket
+	rlnode_init(&(scb->socket_union.unbound_s->unbound_socket), NULL);				 // Initialize the queue
+	FCB_publish(fcb, scb, &socket_file_ops);										 // Set the stream object and function
+	return scb;
+}
+
 Fid_t sys_Socket(port_t port)
 {
 	if (port < 0 || port > MAX_PORT)
@@ -146,15 +193,7 @@ Fid_t sys_Socket(port_t port)
 		return NOFILE;
 	}
 
-	SCB *scb = (SCB *)xmalloc(sizeof(SCB));											 // Allocate memory for the socket control block
-	scb->refcount = 1;																 // Set the reference count to 1
-	scb->fcb = fcb[0];																 // Set the file control block
-	scb->type = SOCKET_UNBOUND;														 // Set the socket type to unbound
-	scb->port = port;																 // Set the port number
-	scb->socket_union.unbound_s = (unbound_socket *)xmalloc(sizeof(unbound_socket)); // Allocate memory for the unbound socket
-	rlnode_init(&(scb->socket_union.unbound_s->unbound_socket), NULL);				 // Initialize the queue
-	fcb[0]->streamobj = scb;														 // Set the stream object
-	fcb[0]->streamfunc = &socket_file_ops;											 // Set the stream function
+	socket_open(fcb[0], port);
 
 	return fid[0];
 }
@@ -166,30 +205,32 @@ int sys_Listen(Fid_t sock)
 		return -1; // Not legal socket
 	}
 
-	FCB *fcb = get_fcb(sock); // Get the FCB from the socket
-
 	// Necessary checks
-	if (fcb == NULL)
-	{
-		return -1; // Invalid fcb
-	}
-	SCB *scb = fcb->streamobj;
+	FCB *fcb;
+	SCB *scb = get_scb(sock, &fcb); // Get the SCB from the socket
 	if (scb == NULL)
 	{
 		return -1; // Invalid socket
 	}
 	if (scb->port == NOPORT)
 	{
+		FCB_decref(fcb);
 		return -1; // Socket is not bound to a port
 	}
 
+	Mutex_Lock(&port_map_lock);
+
 	if (scb->type != SOCKET_UNBOUND)
 	{
+		Mutex_Unlock(&port_map_lock);
+		FCB_decref(fcb);
 		return -1; // Socket is not unbound
 	}
 
 	if (PORT_MAP[scb->port] != NULL && PORT_MAP[scb->port]->type == SOCKET_LISTENER)
 	{
+		Mutex_Unlock(&port_map_lock);
+		FCB_decref(fcb);
 		return -1; // Socket has already been initialized
 	}
 
@@ -203,6 +244,8 @@ int sys_Listen(Fid_t sock)
 	scb->socket_union.listener_s = (listener_socket *)xmalloc(sizeof(listener_socket));
 	rlnode_init(&(scb->socket_union.listener_s->queue), NULL);
 	scb->socket_union.listener_s->req_available = COND_INIT;
+	Mutex_Unlock(&port_map_lock);
+	FCB_decref(fcb);
 	return 0;
 }
 
@@ -213,46 +256,60 @@ Fid_t sys_Accept(Fid_t lsock)
 		return NOFILE; // Not legal socket
 	}
 
-	FCB *fcb = get_fcb(lsock); // Get the FCB from the listening socket
-
 	// Necessary checks
-	if (fcb == NULL)
-	{
-		return NOFILE; // Invalid fcb
-	}
-	SCB *scb = fcb->streamobj;
+	FCB *lfcb;
+	SCB *scb = get_scb(lsock, &lfcb); // Get the SCB from the listening socket
 	if (scb == NULL)
 	{
 		return NOFILE; // Invalid socket
 	}
 	if (scb->port == NOPORT)
 	{
+		FCB_decref(lfcb);
 		return NOFILE; // Socket is not bound to a port
 	}
+
+	/* Construct the server peer here, since port_map_lock is taken after
+	   PCB.lock and fcb_lock. It gets a fid only once it is connected, so
+	   that no other thread of the process can close it meanwhile. */
+	FCB *sfcb = FCB_fid_available() ? acquire_FCB() : NULL;
+	if (sfcb == NULL)
+	{
+		FCB_decref(lfcb);
+		return NOFILE; // Could not create socket
+	}
+	FCB_incref(sfcb);
+	SCB *server = socket_open(sfcb, scb->port);
+
+	Mutex_Lock(&port_map_lock);
+
 	if (scb->type != SOCKET_LISTENER)
 	{
+		Mutex_Unlock(&port_map_lock);
+		FCB_decref(lfcb);
+		FCB_decref(sfcb);
 		return NOFILE; // Socket is not a listener socket
 	}
 
-	scb->refcount++; // Increase the reference count
+	/* While waiting, the listener is kept by its reference count instead of
+	   its FCB, so that closing it can wake us up */
+	scb->refcount++;
+	Mutex_Unlock(&port_map_lock);
+	FCB_decref(lfcb);
+	Mutex_Lock(&port_map_lock);
 
 	// Wait for a connection request while we do not have any requests && the port is still valid
 	while (is_rlist_empty(&scb->socket_union.listener_s->queue) && PORT_MAP[scb->port] != NULL)
 	{
-		kernel_wait(&scb->socket_union.listener_s->req_available, SCHED_USER);
+		kernel_wait(&port_map_lock, &scb->socket_union.listener_s->req_available, SCHED_USER);
 	}
 
-	// Check if the port is still valid (might have been closed while we were waiting)
-	if (PORT_MAP[scb->port] == NULL)
-	{
-		scb->refcount--; // Decrease the reference count
-		return NOFILE;	 // Port is no longer valid
-	}
+	int accepted = 0;
 
-	if (scb == NULL || scb->type != SOCKET_LISTENER || scb != PORT_MAP[scb->port])
+	// Check if the port is still valid (might have been closed while we were waiting)
+	if (PORT_MAP[scb->port] == NULL || scb->type != SOCKET_LISTENER || scb != PORT_MAP[scb->port])
 	{
-		scb->refcount--;
-		return NOFILE;
+		goto finish; // Port is no longer valid
 	}
 
 	// Get the first connection request from the queue
@@ -260,32 +317,18 @@ Fid_t sys_Accept(Fid_t lsock)
 
 	if (connection_request == NULL)
 	{
-		return NOFILE; // No connection request
+		goto finish; // No connection request
 	}
 
 	connection_request->connection_request->admitted = 1; // Mark the connection request as admitted
 
-	// Construct peer
-	Fid_t peer = sys_Socket(scb->port); // Create a new socket
-	if (peer == NOFILE)
-	{
-		return NOFILE; // Could not create socket
-	}
-
 	// Get the client SCB from the connection request
 	SCB *client = connection_request->connection_request->peer;
 	if (client == NULL)
 	{
-		return NOFILE; // Invalid client
+		goto finish; // Invalid client
 	}
 	client->type = SOCKET_PEER; // Mark the client as SOCKET_PEER
-
-	// Get the server SCB from the listening socket
-	SCB *server = get_fcb(peer)->streamobj;
-	if (server == NULL)
-	{
-		return NOFILE; // Invalid server
-	}
 	server->type = SOCKET_PEER; // Mark the server as SOCKET_PEER
 
 	// Initialize the peer_socket fields of the union
@@ -294,16 +337,18 @@ Fid_t sys_Accept(Fid_t lsock)
 
 	if (writer_pipe == NULL || reader_pipe == NULL)
 	{
-		return NOFILE; // Could not allocate memory for the pipes
+		goto finish; // Could not allocate memory for the pipes
 	}
 
 	// Initialization of the pipes
+	writer_pipe->lock = MUTEX_INIT;
 	writer_pipe->has_space = COND_INIT;
 	writer_pipe->has_data = COND_INIT;
 	writer_pipe->w_position = 0;
 	writer_pipe->r_position = 0;
 	writer_pipe->current_size = 0;
 
+	reader_pipe->lock = MUTEX_INIT;
 	reader_pipe->has_space = COND_INIT;
 	reader_pipe->has_data = COND_INIT;
 	reader_pipe->w_position = 0;
@@ -326,10 +371,15 @@ Fid_t sys_Accept(Fid_t lsock)
 
 	// Signal the Connect side
 	kernel_signal(&connection_request->connection_request->connected_cv);
+	accepted = 1;
 
-	// Decrease refcount
-	scb->refcount--;
+finish:
+	scb->refcount--; // Decrease the reference count
+	Mutex_Unlock(&port_map_lock);
 
+	/* If the fids ran out meanwhile, the new connection is closed */
+	Fid_t peer = accepted ? FCB_install(sfcb) : NOFILE;
+	FCB_decref(sfcb);
 	return peer;
 }
 
@@ -345,17 +395,22 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 		return -1;
 	}
 
-	SCB *scb_peer = get_fcb(sock)->streamobj;
+	FCB *fcb;
+	SCB *scb_peer = get_scb(sock, &fcb);
 
-	if (scb_peer == NULL || scb_peer->type != SOCKET_UNBOUND)
+	if (scb_peer == NULL)
 	{
 		return -1;
 	}
 
+	Mutex_Lock(&port_map_lock);
+
 	SCB *scb_server = PORT_MAP[port];
 
-	if (scb_server == NULL || scb_server->type != SOCKET_LISTENER)
+	if (scb_peer->type != SOCKET_UNBOUND || scb_server == NULL || scb_server->type != SOCKET_LISTENER)
 	{
+		Mutex_Unlock(&port_map_lock);
+		FCB_decref(fcb);
 		return -1;
 	}
 
@@ -370,7 +425,9 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 	scb_peer->refcount++;
 
 	while(req->admitted==0){
-    	if(kernel_timedwait(&req->connected_cv, SCHED_USER,timeout)==0){
+    	if(kernel_timedwait(&port_map_lock, &req->connected_cv, SCHED_USER,timeout)==0){
+    		Mutex_Unlock(&port_map_lock);
+    		FCB_decref(fcb);
     		return -1;
     	}
     }
@@ -391,6 +448,8 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 	rlist_remove(&req->queue_node);
 	free(req);
 
+	Mutex_Unlock(&port_map_lock);
+	FCB_decref(fcb);
 	return returnValue;
 }
 
@@ -405,15 +464,21 @@ int sys_ShutDown(Fid_t sock, shutdown_mode how)
 		return -1; // wrong mode
 	}
 
-	FCB *fcb = get_fcb(sock);
-	if (fcb == NULL)
+	FCB *fcb;
+	SCB *scb = get_scb(sock, &fcb);
+	if (scb == NULL)
 	{
 		return -1; // wrong fcb
 	}
 
-	SCB *scb = fcb->streamobj;
+	Mutex_Lock(&port_map_lock);
+	int type = scb->type;
+	Mutex_Unlock(&port_map_lock);
+
+	int retval = -1;
+
 	// if we have socket and
-	if (scb->refcount != 0 && scb->type == SOCKET_PEER)
+	if (scb->refcount != 0 && type == SOCKET_PEER)
 	{
 		int r = 0;
 		int w = 0;
@@ -422,27 +487,27 @@ int sys_ShutDown(Fid_t sock, shutdown_mode how)
 		{
 		case SHUTDOWN_READ:
 			r = pipe_reader_close(scb->socket_union.peer_s->read_pipe); // close socket's read_pipe
-			return r;
+			retval = r;
 			break;
 
 		case SHUTDOWN_WRITE:
 			w = pipe_writer_close(scb->socket_union.peer_s->write_pipe); // close socket's write_pipe
-			return w;
+			retval = w;
 			break;
 
 		case SHUTDOWN_BOTH: // close socket's both of read-write pipes
 			// checking
 			if ((r + w) == 0) 
 			{
-				return 0; // correct
+				retval = 0; // correct
 			}
-			else
-				return -1;
 			break;
 
 		default:
-			return -1;
+			break;
 		}
 	}
-	return -1;
+
+	FCB_decref(fcb);
+	return retval;
 }
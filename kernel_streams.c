@@ -11,6 +11,9 @@
 FCB FT[MAX_FILES];
 rlnode FCB_freelist;
 
+/* Protects FCB_freelist */
+static Mutex fcb_lock = MUTEX_INIT;
+
 
 void initialize_files()
 {
@@ -26,32 +29,36 @@ void initialize_files()
 
 FCB* acquire_FCB()
 {
+  FCB* fcb = NULL;
+  Mutex_Lock(&fcb_lock);
   if(! is_rlist_empty(& FCB_freelist)) {
-    FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
+    fcb = rlist_pop_front(& FCB_freelist)->fcb;
     fcb->refcount = 0;
-    return fcb;
+    /* Not open until the stream is set up */
+    fcb->streamfunc = NULL;
   }
-  else
-    return NULL;
+  Mutex_Unlock(&fcb_lock);
+  return fcb;
 }
 
 void release_FCB(FCB* fcb)
 {
+  Mutex_Lock(&fcb_lock);
   rlist_push_back(& FCB_freelist, & fcb->freelist_node);
+  Mutex_Unlock(&fcb_lock);
 }
 
 
 void FCB_incref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount++;
+  __atomic_add_fetch(&fcb->refcount, 1, __ATOMIC_RELAXED);
 }
 
 int FCB_decref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount --;
-  if(fcb->refcount==0) {
+  if(__atomic_sub_fetch(&fcb->refcount, 1, __ATOMIC_ACQ_REL)==0) {
     int retval = fcb->streamfunc->Close(fcb->streamobj);
     release_FCB(fcb);
     return retval;
@@ -68,6 +75,8 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
     size_t f=0;
     uint i;
 
+    Mutex_Lock(&cur->lock);
+
     /* Find distinct fids */
     for(i=0; i<num; i++) {
 	while(f<MAX_FILEID && cur->FIDT[f]!=NULL)
@@ -75,7 +84,7 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	if(f==MAX_FILEID) break;
 	fid[i] = f; f++;
     }
-    if(i<num) return 0;
+    if(i<num) goto fail;
     /* Allocate FCBs */
     for(i=0;i<num;i++)
 	if((fcb[i] = acquire_FCB()) == NULL)
@@ -86,14 +95,19 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	    release_FCB(fcb[i-1]);
 	    i--;
 	}
-	return 0;
+	goto fail;
     }
     /* Found all */
     for(i=0;i<num;i++) {
 	cur->FIDT[fid[i]]=fcb[i];
 	FCB_incref(fcb[i]);
     }
+    Mutex_Unlock(&cur->lock);
     return 1;
+
+fail:
+    Mutex_Unlock(&cur->lock);
+    return 0;
 }
 
 
@@ -101,14 +115,53 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
+    Mutex_Lock(&cur->lock);
     for(size_t i=0; i<num ; i++) {
 	assert(cur->FIDT[fid[i]]==fcb[i]);
 	cur->FIDT[fid[i]] = NULL;
 	release_FCB(fcb[i]);
     }
+    Mutex_Unlock(&cur->lock);
 }
 
 
+void FCB_publish(FCB* fcb, void* streamobj, file_ops* streamfunc)
+{
+  fcb->streamobj = streamobj;
+  __atomic_store_n(&fcb->streamfunc, streamfunc, __ATOMIC_RELEASE);
+}
+
+
+int FCB_fid_available()
+{
+    PCB* cur = CURPROC;
+    int found = 0;
+
+    Mutex_Lock(&cur->lock);
+    for(Fid_t f=0; f<MAX_FILEID && !found; f++)
+	found = (cur->FIDT[f]==NULL);
+    Mutex_Unlock(&cur->lock);
+    return found;
+}
+
+
+Fid_t FCB_install(FCB* fcb)
+{
+    PCB* cur = CURPROC;
+    Fid_t fid = NOFILE;
+
+    Mutex_Lock(&cur->lock);
+    for(Fid_t f=0; f<MAX_FILEID; f++)
+	if(cur->FIDT[f]==NULL) {
+	    cur->FIDT[f] = fcb;
+	    FCB_incref(fcb);
+	    fid = f;
+	    break;
+	}
+    Mutex_Unlock(&cur->lock);
+    return fid;
+}
+
 
 
 
@@ -128,6 +181,23 @@ FCB* get_fcb(Fid_t fid)
 }
 
 
+FCB* get_fcb_ref(Fid_t fid)
+{
+  if(fid < 0 || fid >= MAX_FILEID) return NULL;
+
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->lock);
+  FCB* fcb = cur->FIDT[fid];
+  if(fcb != NULL && __atomic_load_n(&fcb->streamfunc, __ATOMIC_ACQUIRE) != NULL)
+    FCB_incref(fcb);
+  else
+    fcb = NULL;
+  Mutex_Unlock(&cur->lock);
+
+  return fcb;
+}
+
+
 int sys_Read(Fid_t fd, char *buf, unsigned int size)
 {
   int retcode = -1;
@@ -135,16 +205,13 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
   void* sobj;
 
   
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* Get the fields from the stream, making sure that the stream 
+     will not be closed (by another thread) while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
     sobj = fcb->streamobj;
     devread = fcb->streamfunc->Read;
-
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
   
     if(devread)
       retcode = devread(sobj, buf, size);
@@ -152,9 +219,6 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
   }
-  
-  /* We must not go into non-preemptive domain with kernel_mutex locked */
-
 
   return retcode;
 }
@@ -167,19 +231,15 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
   void* sobj = NULL;
 
   
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* Get the fields from the stream, making sure that the stream 
+     will not be closed (by another thread) while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
 
     sobj = fcb->streamobj;
     devwrite = fcb->streamfunc->Write;
 
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
-
     if(devwrite)
       retcode = devwrite(sobj, buf, size);
 
@@ -197,12 +257,20 @@ int sys_Close(int fd)
 {
   int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
 
+  if(retcode < 0) return retcode;
+
+  /* Take the stream out of the table, and close it unlocked */
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->lock);
   FCB* fcb = get_fcb(fd);
+  if(fcb && __atomic_load_n(&fcb->streamfunc, __ATOMIC_ACQUIRE))
+    cur->FIDT[fd] = NULL;
+  else
+    fcb = NULL;
+  Mutex_Unlock(&cur->lock);
 
-  if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
+  if(fcb)
     retcode = FCB_decref(fcb);    
-  }
 
   return retcode;
 }
@@ -221,18 +289,27 @@ int sys_Dup2(int oldfd, int newfd)
   if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
     return -1;
 
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->lock);
   FCB* old = get_fcb(oldfd);
   FCB* new = get_fcb(newfd);
 
-  if(old==NULL) {
+  if(old==NULL || __atomic_load_n(&old->streamfunc, __ATOMIC_ACQUIRE)==NULL
+     || (new!=NULL && __atomic_load_n(&new->streamfunc, __ATOMIC_ACQUIRE)==NULL)) {
     retcode = -1;
+    new = NULL;
   }
   else if(old!=new) {
-    if(new)
-      FCB_decref(new);
     FCB_incref(old);
-    CURPROC->FIDT[newfd] = old;
+    cur->FIDT[newfd] = old;
   }
+  else
+    new = NULL;
+  Mutex_Unlock(&cur->lock);
+
+  /* Close the replaced stream unlocked */
+  if(new)
+    FCB_decref(new);
 
   return retcode;
 }
@@ -252,15 +329,18 @@ Fid_t open_stream(Device_type major, unsigned int minor)
 {
   Fid_t fid;
   FCB* fcb;
+  void* streamobj;
+  file_ops* streamfunc;
 
 
   if(! FCB_reserve(1, &fid, &fcb))
       goto finerr;
   
-  if(device_open(major, minor, & fcb->streamobj, &fcb->streamfunc)) {
+  if(device_open(major, minor, &streamobj, &streamfunc)) {
       FCB_unreserve(1, &fid, &fcb);
       goto finerr;
   }
+  FCB_publish(fcb, streamobj, streamfunc);
   
   goto finok;
 finerr:
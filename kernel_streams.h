@@ -40,9 +40,10 @@
  */
 typedef struct file_control_block
 {
-  uint refcount;  			/**< @brief Reference counter. */
+  uint refcount;  			/**< @brief Reference counter, updated atomically. */
   void* streamobj;			/**< @brief The stream object (e.g., a device) */
-  file_ops* streamfunc;		/**< @brief The stream implementation methods */
+  file_ops* streamfunc;		/**< @brief The stream implementation methods, 
+  								or NULL while the stream is being opened */
   rlnode freelist_node;		/**< @brief Intrusive list node */
 } FCB;
 
@@ -118,15 +119,75 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb);
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 
 
+/** @brief Open the stream of a reserved FCB.
+
+   Set the stream object and the stream methods of an FCB obtained by
+   @ref FCB_reserve. The methods are stored last, with release semantics,
+   since a non-NULL @c streamfunc tells the other threads of the process
+   (see @ref get_fcb_ref) that the stream is open and @c streamobj is valid.
+
+   @param fcb the reserved FCB
+   @param streamobj the stream object
+   @param streamfunc the stream methods
+*/
+void FCB_publish(FCB* fcb, void* streamobj, file_ops* streamfunc);
+
+
+/** @brief Acquire an FCB without a fid.
+
+   The FCB is returned with a reference count of 0 and no stream. The
+   caller takes its reference with @ref FCB_incref and opens it with
+   @ref FCB_publish, and may give it a fid later by @ref FCB_install.
+
+   @returns the FCB, or NULL if no FCB is available.
+*/
+FCB* acquire_FCB();
+
+
+/** @brief Check that the current process has a free fid.
+
+   This is only a hint, since another thread of the process may take
+   the fid before it is used.
+
+   @returns 1 if some fid is free, else 0.
+*/
+int FCB_fid_available();
+
+
+/** @brief Give a free fid of the current process to an open FCB.
+
+   The FIDT takes its own reference to the FCB.
+
+   @param fcb an FCB already opened by @ref FCB_publish
+   @returns the new fid, or NOFILE if no fid is free.
+*/
+Fid_t FCB_install(FCB* fcb);
+
+
 /** @brief Translate an fid to an FCB.
 
 	This routine will return NULL if the fid is not legal.
 
+	The FCB may be closed by another thread, unless the caller
+	holds @c CURPROC->lock. Use @ref get_fcb_ref to use the stream.
+
 	@param fid the file ID to translate to a pointer to FCB
 	@returns a pointer to the corresponding FCB, or NULL.
  */
 FCB* get_fcb(Fid_t fid);
 
+/** @brief Translate an fid to an FCB, and take a reference to it.
+
+	This routine will return NULL if the fid is not legal, or if its
+	stream is still being opened. Else, the reference count of the 
+	FCB is increased, so that the stream remains open until the caller
+	calls @ref FCB_decref.
+
+	@param fid the file ID to translate to a pointer to FCB
+	@returns a pointer to the corresponding FCB, or NULL.
+ */
+FCB* get_fcb_ref(Fid_t fid);
+
 
 /** @} */
 
@@ -1,4 +1,5 @@
 
+#include <assert.h>
 #include "tinyos.h"
 #include "kernel_sys.h"
 #include "kernel_cc.h"
@@ -9,17 +10,22 @@
 
 /*
 	Define all the syscalls 
- */
-
-
-#define PRE_CALL \
-kernel_lock();\
-
 
+	The wrappers take no lock; each system call locks the kernel 
+	objects that it uses (see kernel_cc.c).
+ */
 
-#define POST_CALL \
-kernel_unlock();\
 
+/*
+	A system call is entered, and must return, with preemption on. Many
+	system calls turn preemption off internally (e.g., to sleep, or to
+	wake up a thread); a path that forgets to restore it would leave the
+	thread running unpreemptible, and its spinlock-taking callers 
+	unchecked (see Spinlock_Lock). The check is an assertion, so it costs
+	nothing in optimized (NDEBUG) builds.
+ */
+#define PRE_CALL  assert(cpu_interrupts_enabled());
+#define POST_CALL assert(cpu_interrupts_enabled());
 
 /* with return */
 #define SYSCALL(NAME, RET, SIG, ARGS)\
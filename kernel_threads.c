@@ -9,6 +9,154 @@
 
 #include <assert.h>
 
+/*
+ *
+ * Thread handles
+ *
+ */
+
+/*
+  A tid is (gen << TID_INDEX_BITS) | (index + 1), so that NOTHREAD (0) is
+  never a legal tid.
+ */
+#define TID_INDEX_BITS 24
+#define TID_INDEX_MASK (((Tid_t)1 << TID_INDEX_BITS) - 1)
+
+/* The initial size of a thread handle table; it doubles when full */
+#define THREAD_TABLE_INIT 8
+
+/* PTCBs are allocated in slabs of this many, and never returned to the C heap */
+#define PTCB_SLAB 64
+
+/* The PTCB pool; the tcb field links the free list */
+static PTCB *ptcb_freelist = NULL;
+static Mutex ptcb_freelist_lock = MUTEX_INIT;
+
+static PTCB *alloc_PTCB()
+{
+  Mutex_Lock(&ptcb_freelist_lock);
+  if (ptcb_freelist == NULL)
+  {
+    PTCB *slab = (PTCB *)xmalloc(PTCB_SLAB * sizeof(PTCB));
+    for (int i = 0; i < PTCB_SLAB; i++)
+    {
+      slab[i].tcb = (TCB *)ptcb_freelist;
+      ptcb_freelist = &slab[i];
+    }
+  }
+
+  PTCB *ptcb = ptcb_freelist;
+  ptcb_freelist = (PTCB *)ptcb->tcb;
+  Mutex_Unlock(&ptcb_freelist_lock);
+  return ptcb;
+}
+
+static void free_PTCB(PTCB *ptcb)
+{
+  Mutex_Lock(&ptcb_freelist_lock);
+  ptcb->tcb = (TCB *)ptcb_freelist;
+  ptcb_freelist = ptcb;
+  Mutex_Unlock(&ptcb_freelist_lock);
+}
+
+/* Grow the thread handle table of a process, chaining the new slots into its free list */
+static void grow_thread_table(PCB *pcb)
+{
+  int oldsize = pcb->thread_table_size;
+  int newsize = (oldsize == 0) ? THREAD_TABLE_INIT : 2 * oldsize;
+  if ((Tid_t)newsize > TID_INDEX_MASK)
+    FATAL("Too many threads in a process");
+
+  thread_handle *table = (thread_handle *)realloc(pcb->thread_table, newsize * sizeof(thread_handle));
+  if (table == NULL)
+    FATAL("virtual memory exhausted");
+  pcb->thread_table = table;
+
+  for (int i = newsize - 1; i >= oldsize; i--)
+  {
+    pcb->thread_table[i].ptcb = NULL;
+    pcb->thread_table[i].gen = 1;
+    pcb->thread_table[i].next_free = pcb->thread_table_free;
+    pcb->thread_table_free = i;
+  }
+  pcb->thread_table_size = newsize;
+}
+
+PTCB *acquire_PTCB(PCB *pcb, TCB *tcb, Task task, int argl, void *args)
+{
+  PTCB *ptcb = alloc_PTCB();
+
+  /* Connect PTCB to TCB and the opposite */
+  ptcb->tcb = tcb;
+  tcb->ptcb = ptcb;
+
+  /* Initialize PTCB */
+  ptcb->task = task;
+  ptcb->argl = argl;
+  ptcb->args = args;
+  ptcb->exited = 0;
+  ptcb->detached = 0;
+  ptcb->exit_cv = COND_INIT;
+  ptcb->refcount = 0;
+  rlnode_init(&ptcb->ptcb_node_list, ptcb); /* Initialize node list with PTCB being the node key */
+  rlist_push_back(&pcb->ptcb_list, &ptcb->ptcb_node_list);
+  pcb->thread_count++;
+  pcb->ptcb_count++;
+
+  /* Take a slot of the handle table */
+  if (pcb->thread_table_free < 0)
+    grow_thread_table(pcb);
+  int i = pcb->thread_table_free;
+  thread_handle *h = &pcb->thread_table[i];
+  pcb->thread_table_free = h->next_free;
+  h->ptcb = ptcb;
+  ptcb->tid = (h->gen << TID_INDEX_BITS) | (Tid_t)(i + 1);
+
+  return ptcb;
+}
+
+void release_PTCB(PCB *pcb, PTCB *ptcb)
+{
+  int i = (int)((ptcb->tid & TID_INDEX_MASK) - 1);
+  thread_handle *h = &pcb->thread_table[i];
+  assert(h->ptcb == ptcb);
+
+  /* Make the tid stale */
+  h->ptcb = NULL;
+  h->gen++;
+  h->next_free = pcb->thread_table_free;
+  pcb->thread_table_free = i;
+
+  rlist_remove(&ptcb->ptcb_node_list);
+  pcb->ptcb_count--;
+  free_PTCB(ptcb);
+}
+
+void release_thread_table(PCB *pcb)
+{
+  while (!is_rlist_empty(&pcb->ptcb_list))
+    free_PTCB(rlist_pop_front(&pcb->ptcb_list)->obj);
+
+  pcb->ptcb_count = 0;
+
+  free(pcb->thread_table);
+  pcb->thread_table = NULL;
+  pcb->thread_table_size = 0;
+  pcb->thread_table_free = -1;
+}
+
+PTCB *get_ptcb(PCB *pcb, Tid_t tid)
+{
+  Tid_t index = tid & TID_INDEX_MASK;
+  if (index == 0 || index > (Tid_t)pcb->thread_table_size)
+    return NULL;
+
+  thread_handle *h = &pcb->thread_table[index - 1];
+  if (h->ptcb == NULL || (h->gen << TID_INDEX_BITS) != (tid & ~TID_INDEX_MASK))
+    return NULL;
+  return h->ptcb;
+}
+
 /**
   @brief Create a new thread in the current process.
   */
@@ -27,47 +175,89 @@
   sys_ThreadExit(exitval);
 }*/
 
+/*
+  Create a thread with the given stack size and a new PTCB, in the
+  current process. The thread is not woken up.
+ */
+static PTCB *create_thread(Task task, int argl, void *args, size_t stack_size, int detached)
+{
+  /* Initialize and return a new TCB */
+  PCB *pcb = CURPROC;
+  TCB *tcb = spawn_thread_stack(pcb, start_main_thread_process, stack_size);
+
+  /*  and acquire a new PTCB */
+  Mutex_Lock(&pcb->lock);
+  PTCB *ptcb = acquire_PTCB(pcb, tcb, task, argl, args);
+  ptcb->detached = detached;
+  Mutex_Unlock(&pcb->lock);
+
+  return ptcb;
+}
+
 Tid_t sys_CreateThread(Task task, int argl, void *args)
 {
   if (task != NULL)
   {
-    /* Initialize and return a new TCB */
-    PCB *pcb = CURPROC;
-    TCB *tcb;
-    tcb = spawn_thread(pcb, start_main_thread_process);
-    /*  and acquire a new PTCB */
-    PTCB *ptcb;
-    ptcb = (PTCB *)xmalloc(sizeof(PTCB)); /* Memory allocation for the new PTCB */
-
-    /* Connect PTCB to TCB and the opposite */
-    ptcb->tcb = tcb;
-    tcb->ptcb = ptcb;
-
-    /* Initialize PTCB */
-    ptcb->task = task;
-    ptcb->argl = argl;
-    ptcb->args = args;
-    ptcb->exited = 0;
-    ptcb->detached = 0;
-    ptcb->exit_cv = COND_INIT;
-    ptcb->refcount = 0;
-    rlnode_init(&ptcb->ptcb_node_list, ptcb); /* Initialize node list with PTCB being the node key */
-    // ptcb->ptcb_node_list = *rlnode_init(&ptcb->ptcb_node_list, ptcb);
-    rlist_push_back(&CURPROC->ptcb_list, &ptcb->ptcb_node_list);
-    pcb->thread_count++;
-    wakeup(tcb);
-
-    return (Tid_t)ptcb;
+    PTCB *ptcb = create_thread(task, argl, args, THREAD_STACK_SIZE, 0);
+    Tid_t tid = ptcb->tid;
+    wakeup(ptcb->tcb);
+
+    return tid;
   }
   return NOTHREAD;
 }
 
+/**
+  @brief Create a new thread in the current process, with the given attributes.
+  */
+Tid_t sys_CreateThreadAttr(Task task, int argl, void *args, const thread_attr *attr)
+{
+  thread_attr dflt = THREAD_ATTR_INIT;
+  if (attr == NULL)
+    attr = &dflt;
+
+  if (task == NULL || attr->stack_size > THREAD_MAX_STACK_SIZE)
+    return NOTHREAD;
+
+  switch (attr->sclass)
+  {
+  case SCHED_CLASS_NORMAL:
+    if (attr->priority < 0 || attr->priority > MAX_NORMAL_PRIORITY)
+      return NOTHREAD;
+    break;
+  case SCHED_CLASS_FIFO:
+  case SCHED_CLASS_RR:
+    if (attr->priority < 0 || attr->priority > MAX_RT_PRIORITY)
+      return NOTHREAD;
+    break;
+  default:
+    return NOTHREAD;
+  }
+
+  size_t stack_size = (attr->stack_size == 0) ? THREAD_STACK_SIZE : attr->stack_size;
+  /* Detached at birth: nobody can join it */
+  PTCB *ptcb = create_thread(task, argl, args, stack_size, attr->detached != 0);
+
+  /* The thread has not been woken up yet, so its fields are ours to set */
+  TCB *tcb = ptcb->tcb;
+  tcb->sclass = attr->sclass;
+  if (attr->sclass == SCHED_CLASS_NORMAL)
+    tcb->priority = attr->priority;
+  else
+    tcb->rt_priority = attr->priority;
+
+  /* Once woken up, a detached thread may exit and release its PTCB */
+  Tid_t tid = ptcb->tid;
+  wakeup(tcb);
+  return tid;
+}
+
 /**
   @brief Return the Tid of the current thread.
  */
 Tid_t sys_ThreadSelf()
 {
-  return (Tid_t)cur_thread()->ptcb;
+  return cur_thread()->ptcb->tid;
 }
 
 /**
@@ -75,20 +265,23 @@ Tid_t sys_ThreadSelf()
   */
 int sys_ThreadJoin(Tid_t tid, int *exitval)
 {
-  PTCB *ptcb = (PTCB *)tid;
-  // PCB* pcb= CURPROC;
+  PCB *curproc = CURPROC;
+  int retval = -1;
 
-  if (rlist_find(&CURPROC->ptcb_list, ptcb, NULL) == NULL) /*search the list of ptcbs looking for ptcb with the given id(key)*/
+  Mutex_Lock(&curproc->lock);
+  PTCB *ptcb = get_ptcb(curproc, tid);
+
+  if (ptcb == NULL) /*look up the ptcb with the given id in the thread handle table*/
   {
-    return -1; /*if it's null return error.*/
+    goto finish; /*if it's null return error.*/
   }
   if (sys_ThreadSelf() == tid) /*if id of thread calling thread join is the same as the given id return error.*/
   {
-    return -1;
+    goto finish;
   }
   if (ptcb->detached == 1) /*if the thread that calling thread wants to join is detached return error*/
   {
-    return -1;
+    goto finish;
   }
 
   /*if (ptcb->exited == 1)
@@ -100,13 +293,16 @@ int sys_ThreadJoin(Tid_t tid, int *exitval)
 
   while (ptcb->exited == 0 && ptcb->detached == 0)
   {
-    kernel_wait(&ptcb->exit_cv, SCHED_USER);
+    kernel_wait(&curproc->lock, &ptcb->exit_cv, SCHED_USER);
   }
   ptcb->refcount--;
 
   if (ptcb->detached == 1) /*if the thread that calling thread wants to join is detached return error*/
   {
-    return -1;
+    /* The exited thread left its PTCB to the last woken joiner */
+    if (ptcb->refcount == 0 && ptcb->exited == 1)
+      release_PTCB(curproc, ptcb);
+    goto finish;
   }
 
   if (exitval != NULL)
@@ -116,11 +312,14 @@ int sys_ThreadJoin(Tid_t tid, int *exitval)
 
   if (ptcb->refcount == 0)
   {
-    rlist_remove(&ptcb->ptcb_node_list);
-    free(ptcb);
+    release_PTCB(curproc, ptcb);
   }
 
-  return 0;
+  retval = 0;
+
+finish:
+  Mutex_Unlock(&curproc->lock);
+  return retval;
 }
 
 /**
@@ -128,15 +327,14 @@ int sys_ThreadJoin(Tid_t tid, int *exitval)
   */
 int sys_ThreadDetach(Tid_t tid)
 {
-  PTCB *ptcb = (PTCB *)tid;
+  PCB *curproc = CURPROC;
 
-  if (rlist_find(&CURPROC->ptcb_list, ptcb, NULL) == NULL)
-  {
-    return -1;
-  }
+  Mutex_Lock(&curproc->lock);
+  PTCB *ptcb = get_ptcb(curproc, tid);
 
-  if (ptcb->exited == 1)
+  if (ptcb == NULL || ptcb->exited == 1)
   { // Check if the flag exited is on.If it is return error.
+    Mutex_Unlock(&curproc->lock);
     return -1;
   }
 
@@ -147,10 +345,73 @@ int sys_ThreadDetach(Tid_t tid)
   ptcb->detached = 1; // if everything is right make detach flag on.
   kernel_broadcast(&ptcb->exit_cv);
   // ptcb->refcount=0;
+  Mutex_Unlock(&curproc->lock);
 
   return 0;
 }
 
+/**
+  @brief Set the scheduling class and priority of a thread.
+  */
+int sys_SetSchedParam(Tid_t tid, sched_class sclass, int prio)
+{
+  switch (sclass)
+  {
+  case SCHED_CLASS_NORMAL:
+    if (prio != 0)
+      return -1;
+    break;
+  case SCHED_CLASS_FIFO:
+  case SCHED_CLASS_RR:
+    if (prio < 0 || prio > MAX_RT_PRIORITY)
+      return -1;
+    break;
+  default:
+    return -1;
+  }
+
+  PCB *curproc = CURPROC;
+  Mutex_Lock(&curproc->lock);
+  PTCB *ptcb = get_ptcb(curproc, tid);
+
+  if (ptcb == NULL || ptcb->exited == 1)
+  {
+    Mutex_Unlock(&curproc->lock);
+    return -1;
+  }
+
+  int demoted = sched_set_param(ptcb->tcb, sclass, prio);
+  Mutex_Unlock(&curproc->lock);
+
+  /* Let any thread that now outranks us run, now that it can take curproc->lock */
+  if (demoted)
+    yield(SCHED_USER);
+  return 0;
+}
+
+/**
+  @brief Get the scheduling class and priority of a thread.
+  */
+int sys_GetSchedParam(Tid_t tid, sched_class *sclass, int *prio)
+{
+  PCB *curproc = CURPROC;
+  Mutex_Lock(&curproc->lock);
+  PTCB *ptcb = get_ptcb(curproc, tid);
+
+  if (ptcb == NULL || ptcb->exited == 1)
+  {
+    Mutex_Unlock(&curproc->lock);
+    return -1;
+  }
+
+  if (sclass != NULL)
+    *sclass = ptcb->tcb->sclass;
+  if (prio != NULL)
+    *prio = ptcb->tcb->rt_priority;
+  Mutex_Unlock(&curproc->lock);
+  return 0;
+}
+
 /**
   @brief Terminate the current thread.
   */
@@ -160,13 +421,57 @@ void sys_ThreadExit(int exitval)
   TCB *tcb = cur_thread();
   PTCB *ptcb = tcb->ptcb;
 
+  /* Report how deep the stack of the thread got */
+  if (sched_stack_paint_enabled())
+    stack_stats_record(ptcb->task, tcb->stack_size, thread_stack_depth(tcb));
+
+  Mutex_Lock(&curproc->lock);
   curproc->thread_count--; // Thread is going to get deleted
   ptcb->exited = 1;
   ptcb->exitval = exitval;
   kernel_broadcast(&ptcb->exit_cv); // Leave kernel_wait() from ThreadJoin
 
-  if (curproc->thread_count == 0)
+  /* Nobody can join a detached thread, so reclaim its PTCB now, unless
+     a joiner woken up by ThreadDetach still has to see it */
+  if (ptcb->detached == 1 && ptcb->refcount == 0)
   {
+    tcb->ptcb = NULL;
+    release_PTCB(curproc, ptcb);
+  }
+
+  int last_thread = (curproc->thread_count == 0);
+  Mutex_Unlock(&curproc->lock);
+
+  if (last_thread)
+  {
+    /*
+      Do all the cleanup we want here, close files etc. No other thread
+      of the process is left to use them.
+     */
+
+    /* Clean up FIDT */
+    for (int i = 0; i < MAX_FILEID; i++)
+    {
+      if (curproc->FIDT[i] != NULL)
+      {
+        FCB_decref(curproc->FIDT[i]);
+        curproc->FIDT[i] = NULL;
+      }
+    }
+
+    /* Release the PTCBs of all threads, including mine */
+    Mutex_Lock(&curproc->lock);
+    release_thread_table(curproc);
+    Mutex_Unlock(&curproc->lock);
+
+    /* Disconnect my main_thread */
+    curproc->main_thread = NULL;
+
+    /*
+      Make the process a zombie. Once the parent sees it, the PCB may be
+      reused, so this is the last use of curproc.
+     */
+    Mutex_Lock(&proc_lock);
     if (get_pid(curproc) != 1)
     {
       /* Moved from sys_Exit from kernel_proc.c */
@@ -176,7 +481,7 @@ void sys_ThreadExit(int exitval)
       while (!is_rlist_empty(&curproc->children_list))
       {
         rlnode *child = rlist_pop_front(&curproc->children_list);
-        child->pcb->parent = initpcb;
+        __atomic_store_n(&child->pcb->parent, initpcb, __ATOMIC_RELAXED); /* see sys_GetPPid */
         rlist_push_front(&initpcb->children_list, child);
       }
 
@@ -196,32 +501,17 @@ void sys_ThreadExit(int exitval)
     assert(is_rlist_empty(&curproc->children_list));
     assert(is_rlist_empty(&curproc->exited_list));
 
-    /*
-      Do all the other cleanup we want here, close files etc.
-     */
-
-    /* Release the args data */
-    if (curproc->args)
-    {
-      free(curproc->args);
-      curproc->args = NULL;
-    }
-
-    /* Clean up FIDT */
-    for (int i = 0; i < MAX_FILEID; i++)
-    {
-      if (curproc->FIDT[i] != NULL)
-      {
-        FCB_decref(curproc->FIDT[i]);
-        curproc->FIDT[i] = NULL;
-      }
-    }
-
-    /* Disconnect my main_thread */
-    curproc->main_thread = NULL;
+    /* Detach the args data; procinfo_read() copies it under proc_lock */
+    void *args = curproc->args;
+    curproc->args = NULL;
+    curproc->argl = 0;
 
     /* Now, mark the process as exited. */
     curproc->pstate = ZOMBIE;
+    Mutex_Unlock(&proc_lock);
+
+    /* Release the args data */
+    free(args);
   }
 
   /* Bye-bye cruel world */
@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tinyos.h"
+#include "bios.h"
+
+/*
+	A throughput benchmark for system calls.
+
+	One process per core runs a loop of system calls of some workload,
+	on kernel objects of its own, and the total rate is reported. Since
+	the processes share no kernel object, the rate should grow with the
+	number of cores. Build and run with 'make lock_bench'.
+ */
+
+#define DEFAULT_OPS 200000
+
+/* A pipe of the process: write a few bytes and read them back */
+static int pipe_workload(int ops)
+{
+	pipe_t pipe;
+	char buf[64];
+	if(Pipe(&pipe) == -1) return -1;
+
+	memset(buf, 'x', sizeof(buf));
+	for(int i=0; i<ops; i++) {
+		if(Write(pipe.write, buf, sizeof(buf)) != sizeof(buf)) return -1;
+		if(Read(pipe.read, buf, sizeof(buf)) != sizeof(buf)) return -1;
+	}
+
+	Close(pipe.read);
+	Close(pipe.write);
+	return 0;
+}
+
+/* Two threads of the process pass a byte back and forth over two pipes */
+static int pong_thread(int argl, void* args)
+{
+	pipe_t* pipes = args;
+	char c;
+	while(Read(pipes[0].read, &c, 1) == 1)
+		if(Write(pipes[1].write, &c, 1) != 1) return -1;
+	return 0;
+}
+
+static int pingpong_workload(int ops)
+{
+	pipe_t pipes[2];
+	char c = 'x';
+	if(Pipe(&pipes[0]) == -1 || Pipe(&pipes[1]) == -1) return -1;
+
+	Tid_t t = CreateThread(pong_thread, 0, pipes);
+	for(int i=0; i<ops; i++) {
+		if(Write(pipes[0].write, &c, 1) != 1) return -1;
+		if(Read(pipes[1].read, &c, 1) != 1) return -1;
+	}
+	Close(pipes[0].write);
+	if(ThreadJoin(t, NULL) != 0) return -1;
+
+	Close(pipes[0].read);
+	Close(pipes[1].read);
+	Close(pipes[1].write);
+	return 0;
+}
+
+/* The file table of the process: copy a stream and close the copy */
+static int dup_workload(int ops)
+{
+	Fid_t fid = OpenNull();
+	if(fid == NOFILE) return -1;
+
+	for(int i=0; i<ops; i++) {
+		if(Dup2(fid, fid+1) == -1) return -1;
+		if(Close(fid+1) == -1) return -1;
+	}
+
+	Close(fid);
+	return 0;
+}
+
+/* The read-only system calls, which take no lock */
+static int getpid_workload(int ops)
+{
+	Pid_t pid = GetPid();
+	for(int i=0; i<ops; i++)
+		if(GetPid() != pid) return -1;
+	return 0;
+}
+
+static int getppid_workload(int ops)
+{
+	Pid_t ppid = GetPPid();
+	for(int i=0; i<ops; i++)
+		if(GetPPid() != ppid) return -1;
+	return 0;
+}
+
+typedef struct workload {
+	const char* name;
+	int (*run)(int ops);
+} workload;
+
+static const workload workloads[] = {
+	{ "pipe", pipe_workload },
+	{ "pingpong", pingpong_workload },
+	{ "dup", dup_workload },
+	{ "getpid", getpid_workload },
+	{ "getppid", getppid_workload },
+	{ NULL, NULL }
+};
+
+typedef struct bench {
+	const workload* w;
+	int ops;
+} bench;
+
+static int bench_process(int argl, void* args)
+{
+	bench* b = args;
+	return b->w->run(b->ops);
+}
+
+static int boot_bench(int argl, void* args)
+{
+	bench* b = args;
+	uint nprocs = cpu_cores();
+
+	TimerDuration t0 = bios_clock_precise();
+	for(uint i=0; i<nprocs; i++)
+		Exec(bench_process, sizeof(bench), b);
+
+	int failed = 0, status;
+	while(WaitChild(NOPROC, &status) != NOPROC)
+		if(status != 0) failed++;
+	TimerDuration t = bios_clock_precise() - t0;
+
+	unsigned long ops = (unsigned long) nprocs * b->ops;
+	if(failed)
+		fprintf(stderr, "%s: %d of %u processes FAILED\n", b->w->name, failed, nprocs);
+	else
+		fprintf(stderr, "%s: %u cores, %lu ops in %lu usec, %.0f ops/sec\n",
+			b->w->name, nprocs, ops, (unsigned long) t, ops*1E6/t);
+	return failed;
+}
+
+static void usage(const char* pname)
+{
+	fprintf(stderr, "usage:\n  %s <ncores> <workload> [<ops>]\n\n"
+		"  where <workload> is one of:", pname);
+	for(const workload* w = workloads; w->name != NULL; w++)
+		fprintf(stderr, " %s", w->name);
+	fprintf(stderr, "\n  and <ops> is the number of loops per process (default %d)\n", DEFAULT_OPS);
+	exit(1);
+}
+
+int main(int argc, const char** argv)
+{
+	if(argc < 3 || argc > 4) usage(argv[0]);
+
+	unsigned int ncores = atoi(argv[1]);
+	if(ncores == 0 || ncores > MAX_CORES) usage(argv[0]);
+
+	bench b = { .w = NULL, .ops = (argc == 4) ? atoi(argv[3]) : DEFAULT_OPS };
+	for(const workload* w = workloads; w->name != NULL; w++)
+		if(strcmp(w->name, argv[2]) == 0)
+			b.w = w;
+	if(b.w == NULL || b.ops <= 0) usage(argv[0]);
+
+	boot(ncores, 0, boot_bench, sizeof(b), &b);
+	return 0;
+}
@@ -0,0 +1,159 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "unit_testing.h"
+#include "kernel_cc.h"
+
+#undef NDEBUG
+#include <assert.h>
+
+
+/* Unit tests for the internal locks of the kernel */
+
+
+static void spinlock_trylock_core()
+{
+	Spinlock lock = SPINLOCK_INIT;
+	cpu_disable_interrupts();
+
+	ASSERT(Spinlock_TryLock(&lock));
+	ASSERT(! Spinlock_TryLock(&lock));
+	Spinlock_Unlock(&lock);
+
+	/* Move the tickets across the wraparound */
+	lock.next = lock.owner = 0xFFFE;
+	for(int i=0; i<4; i++) {
+		Spinlock_Lock(&lock);
+		ASSERT(! Spinlock_TryLock(&lock));
+		Spinlock_Unlock(&lock);
+	}
+	ASSERT(lock.next == lock.owner);
+	ASSERT(lock.owner == 2);
+	cpu_enable_interrupts();
+}
+
+BARE_TEST(test_spinlock_trylock,
+	"Test Spinlock_TryLock on a free and a busy spinlock, including ticket wraparound"
+	)
+{
+	/* Spinlocks are taken with preemption off, on a core */
+	vm_boot(spinlock_trylock_core, 1, 0);
+}
+
+
+/*
+	Run a loop on all cores of a simulated machine, with preemption off,
+	starting together. Each core locks and unlocks a shared lock, counting
+	its acquisitions, until the deadline.
+ */
+
+#define LOCK_BENCH_CORES_MAX 16
+
+static struct {
+	int spinlock;			/* Use the Spinlock, else the Mutex */
+	TimerDuration duration;	/* Run the loop for this long (0: run 'rounds' times) */
+	unsigned long rounds;
+
+	Mutex mutex;
+	Spinlock spinlock_;
+	unsigned long counter;	/* Protected by the lock */
+	unsigned long count[LOCK_BENCH_CORES_MAX];
+
+	unsigned int arrived;
+	TimerDuration start;
+} lb;
+
+static void lock_bench_core()
+{
+	cpu_disable_interrupts();
+
+	/* Start together */
+	if(__atomic_add_fetch(&lb.arrived, 1, __ATOMIC_ACQ_REL) == cpu_cores())
+		__atomic_store_n(&lb.start, bios_clock_precise(), __ATOMIC_RELEASE);
+	while(__atomic_load_n(&lb.start, __ATOMIC_ACQUIRE) == 0);
+	TimerDuration deadline = lb.start + lb.duration;
+
+	unsigned long mine = 0;
+	for(;;) {
+		if(lb.duration > 0) {
+			if((mine & 63) == 0 && bios_clock_precise() >= deadline) break;
+		}
+		else if(mine == lb.rounds) break;
+
+		if(lb.spinlock) Spinlock_Lock(&lb.spinlock_); else Mutex_Lock(&lb.mutex);
+		lb.counter++;
+		if(lb.spinlock) Spinlock_Unlock(&lb.spinlock_); else Mutex_Unlock(&lb.mutex);
+		mine++;
+	}
+	lb.count[cpu_core_id] = mine;
+
+	cpu_enable_interrupts();
+}
+
+static void lock_bench(int spinlock, uint cores, TimerDuration duration, unsigned long rounds)
+{
+	memset(&lb, 0, sizeof(lb));
+	lb.spinlock = spinlock;
+	lb.duration = duration;
+	lb.rounds = rounds;
+	lb.mutex = MUTEX_INIT;
+	lb.spinlock_ = SPINLOCK_INIT;
+
+	vm_boot(lock_bench_core, cores, 0);
+}
+
+
+BARE_TEST(test_spinlock_mutual_exclusion,
+	"Test that a Spinlock contended by many cores protects its critical section"
+	)
+{
+	const unsigned long N = 20000;
+	for(uint cores=2; cores<=8; cores *= 2) {
+		lock_bench(1, cores, 0, N);
+		ASSERT(lb.counter == cores*N);
+	}
+}
+
+
+BARE_TEST(test_lock_contention,
+	"Compare the throughput and fairness of Mutex and Spinlock under contention",
+	.timeout = 60
+	)
+{
+	const TimerDuration duration = 250000;
+	for(uint cores=2; cores<=LOCK_BENCH_CORES_MAX; cores *= 2) {
+		for(int spinlock=0; spinlock<=1; spinlock++) {
+			lock_bench(spinlock, cores, duration, 0);
+
+			unsigned long total = 0, min = lb.count[0], max = lb.count[0];
+			for(uint c=0; c<cores; c++) {
+				total += lb.count[c];
+				if(lb.count[c] < min) min = lb.count[c];
+				if(lb.count[c] > max) max = lb.count[c];
+			}
+			ASSERT(lb.counter == total);
+
+			MSG("%-8s %2u cores: %8.0f locks/msec, per core min/max = %.2f\n",
+				spinlock ? "Spinlock" : "Mutex", cores, total * 1000.0 / duration,
+				max ? (double)min / max : 0.0);
+		}
+	}
+}
+
+
+TEST_SUITE(all_tests,
+	"All tests")
+{
+	&test_spinlock_trylock,
+	&test_spinlock_mutual_exclusion,
+	&test_lock_contention,
+	NULL
+};
+
+
+int main(int argc, char** argv)
+{
+	return register_test(&all_tests) ||
+		run_program(argc, argv, &all_tests);
+}
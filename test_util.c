@@ -267,6 +267,147 @@ TEST_SUITE(rlist_tests,
 };
 
 
+/* Unit tests for the ordered trees */
+
+
+/* Check the AVL invariants of a subtree, returning its size */
+static size_t check_avl(avlnode* n, avlnode* parent)
+{
+	if(n == NULL) return 0;
+	ASSERT(n->parent == parent);
+	if(n->left) ASSERT(n->left->key <= n->key);
+	if(n->right) ASSERT(n->right->key >= n->key);
+	size_t size = 1 + check_avl(n->left, n) + check_avl(n->right, n);
+	int hl = avl_height(n->left), hr = avl_height(n->right);
+	ASSERT(n->height == 1 + (hl > hr ? hl : hr));
+	ASSERT(hl - hr <= 1 && hr - hl <= 1);
+	return size;
+}
+
+/* Check a tree, including an in-order walk */
+static void check_tree(avltree* T)
+{
+	ASSERT(check_avl(T->root, NULL) == T->size);
+	size_t count = 0;
+	avlnode* prev = NULL;
+	for(avlnode* n = T->first; n != NULL; n = avl_next(n)) {
+		if(prev) ASSERT(prev->key <= n->key);
+		prev = n;
+		count++;
+	}
+	ASSERT(count == T->size);
+	if(T->root == NULL) ASSERT(T->first == NULL);
+}
+
+
+BARE_TEST(test_avl_insert,
+	"Test that inserting into a tree keeps it ordered and balanced."
+	)
+{
+	enum { N = 1000 };
+	static avlnode nodes[N];
+	avltree T;
+	avltree_init(&T);
+	check_tree(&T);
+
+	srand(17);
+	for(int i=0; i<N; i++) {
+		avlnode_init(&nodes[i], &nodes[i])->key = rand() % 100;
+		avl_insert(&T, &nodes[i]);
+		if(i % 97 == 0) check_tree(&T);
+	}
+	check_tree(&T);
+	ASSERT(T.size == N);
+
+	/* Sorted insertion degenerates into a list, unless balanced */
+	avltree_init(&T);
+	for(int i=0; i<N; i++) {
+		avlnode_init(&nodes[i], &nodes[i])->key = i;
+		avl_insert(&T, &nodes[i]);
+	}
+	check_tree(&T);
+	ASSERT(T.root->height <= 11);
+	ASSERT(T.first == &nodes[0]);
+}
+
+
+BARE_TEST(test_avl_fifo,
+	"Test that nodes of equal key are kept in insertion order."
+	)
+{
+	enum { N = 100 };
+	avlnode nodes[N];
+	avltree T;
+	avltree_init(&T);
+
+	for(int i=0; i<N; i++) {
+		avlnode_init(&nodes[i], &nodes[i])->key = (i % 2) ? 5 : 3;
+		avl_insert(&T, &nodes[i]);
+	}
+
+	/* First the even-indexed nodes, then the odd-indexed ones */
+	for(int i=0; i<N; i++) {
+		int expected = (i < N/2) ? 2*i : 2*(i-N/2)+1;
+		ASSERT(T.first == &nodes[expected]);
+		avl_remove(&T, T.first);
+	}
+	ASSERT(T.root == NULL && T.first == NULL && T.size == 0);
+}
+
+
+BARE_TEST(test_avl_remove,
+	"Test removing arbitrary nodes from a tree."
+	)
+{
+	enum { N = 1000 };
+	static avlnode nodes[N];
+	static int intree[N];
+	avltree T;
+	avltree_init(&T);
+
+	srand(42);
+	for(int i=0; i<N; i++) {
+		avlnode_init(&nodes[i], &nodes[i])->key = rand() % 500;
+		avl_insert(&T, &nodes[i]);
+		intree[i] = 1;
+	}
+
+	/* Remove and re-insert random nodes */
+	for(int r=0; r<5*N; r++) {
+		int i = rand() % N;
+		if(intree[i]) 
+			avl_remove(&T, &nodes[i]);
+		else {
+			nodes[i].key = rand() % 500;
+			avl_insert(&T, &nodes[i]);
+		}
+		intree[i] = !intree[i];
+		if(r % 101 == 0) check_tree(&T);
+	}
+	check_tree(&T);
+
+	/* Remove everything, smallest first */
+	uint64_t last = 0;
+	while(T.first != NULL) {
+		ASSERT(T.first->key >= last);
+		last = T.first->key;
+		avl_remove(&T, T.first);
+	}
+	ASSERT(T.size == 0 && T.root == NULL);
+}
+
+
+TEST_SUITE(avltree_tests,
+	"Tests for the ordered trees")
+{
+	&test_avl_insert,
+	&test_avl_fifo,
+	&test_avl_remove,
+	NULL
+};
+
+
+
 
 void test_argv(size_t argc, const char* argv[])
 {
@@ -321,6 +462,7 @@ TEST_SUITE(all_tests,
 	"All tests")
 {
 	&rlist_tests,
+	&avltree_tests,
 	&test_pack_unpack,
 	NULL
 };
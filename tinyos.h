@@ -3,6 +3,7 @@
 #define __TINYOS_H__
 
 #include <stdint.h>
+#include <stddef.h>
 
 /**
   @file tinyos.h
@@ -191,6 +192,18 @@ int Cond_TimedWait(Mutex* mx, CondVar* cv, timeout_t timeout);
    */
 void Cond_Signal(CondVar*);
 
+/** @brief Signal a condition variable, handing the CPU to the woken thread.
+
+   This is like @c Cond_Signal, but the woken thread (if any) runs at once
+   on the current core, in place of the calling thread, which stays ready.
+   This shortens the round-trip between a producer and a consumer.
+
+   The woken thread must lock the mutex before it returns from 
+   @c Cond_Wait, so this call is best made after releasing the mutex.
+   @see Cond_Signal
+   */
+void Cond_SignalHandoff(CondVar*);
+
 /** @brief Notify all threads waiting at a condition variable.
 
   Broadcast wakes up all threads sleeping on this condition variable.
@@ -375,6 +388,102 @@ int ThreadDetach(Tid_t tid);
 void ThreadExit(int exitval);
 
 
+/**
+  @brief Thread scheduling classes.
+
+  Threads of the real-time classes always run ahead of threads of the
+  normal class, and ahead of real-time threads of lower priority. 
+  Unlike normal threads, their priority is never changed by the scheduler.
+
+  @see SetSchedParam
+*/
+typedef enum {
+  SCHED_CLASS_NORMAL=0,  /**< The default class, scheduled by the kernel's scheduler policy. */
+  SCHED_CLASS_FIFO=1,    /**< Real-time, run until it blocks or is preempted by a higher priority. */
+  SCHED_CLASS_RR=2       /**< Real-time, as FIFO but with a time quantum among threads of equal priority. */
+} sched_class;
+
+/** @brief The maximum priority of a real-time thread. The minimum is 0. */
+#define MAX_RT_PRIORITY 31
+
+/** @brief The maximum initial priority of a normal thread. The minimum, and default, is 0. 
+
+  For a normal thread, the priority is the initial level of the thread in
+  the kernel's multi-level feedback queue; the scheduler changes it later.
+*/
+#define MAX_NORMAL_PRIORITY 49
+
+/**
+  @brief Set the scheduling class and priority of a thread.
+
+  The change takes effect immediately: a ready thread is moved to
+  its new place, and a thread that lowers its own priority may be 
+  preempted.
+
+  @param tid the tid of a thread of the current process
+  @param sclass the new scheduling class
+  @param prio the real-time priority, from 0 to @c MAX_RT_PRIORITY. For 
+     the normal class it must be 0.
+  @returns 0 on success, and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the tid corresponds to an exited thread.
+    - the class or priority is illegal.
+  */
+int SetSchedParam(Tid_t tid, sched_class sclass, int prio);
+
+/**
+  @brief Get the scheduling class and priority of a thread.
+
+  @param tid the tid of a thread of the current process
+  @param sclass location to store the class, or NULL
+  @param prio location to store the real-time priority, or NULL
+  @returns 0 on success, and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the tid corresponds to an exited thread.
+  @see SetSchedParam
+  */
+int GetSchedParam(Tid_t tid, sched_class* sclass, int* prio);
+
+
+/**
+  @brief Attributes of a new thread.
+
+  @see CreateThreadAttr
+*/
+typedef struct thread_attr {
+  size_t stack_size;   /**< @brief The stack size, in bytes, or 0 for the default. 
+
+          Small sizes are rounded up to a minimum (16 kbytes). */
+  sched_class sclass;  /**< @brief The scheduling class. */
+  int priority;        /**< @brief The priority, from 0 to @c MAX_RT_PRIORITY for a 
+          real-time class, or from 0 to @c MAX_NORMAL_PRIORITY for the normal class. */
+  int detached;        /**< @brief If non-zero, the thread is created detached. */
+} thread_attr;
+
+/** @brief The default thread attributes, as used by @c CreateThread. */
+#define THREAD_ATTR_INIT ((thread_attr){ .stack_size=0, .sclass=SCHED_CLASS_NORMAL, .priority=0, .detached=0 })
+
+/** 
+  @brief Create a new thread in the current process, with the given attributes.
+
+  This is like @c CreateThread, but the stack size, scheduling class and 
+  priority, and whether the thread is detached are given by @c attr.
+  A detached thread is created without a separate call to @c ThreadDetach.
+
+  @param task a function to execute
+  @param argl the first argument of @c task
+  @param args the second argument of @c task
+  @param attr the thread attributes; if NULL, the defaults are used
+  @returns the tid of the new thread, or NOTHREAD on error. Possible errors are:
+    - @c task is NULL.
+    - the stack size is too large (larger than 64 Mbytes).
+    - the class or priority is illegal.
+  @see CreateThread
+  @see SetSchedParam
+  */
+Tid_t CreateThreadAttr(Task task, int argl, void* args, const thread_attr* attr);
+
+
 
 /*******************************************
  *
@@ -723,6 +832,12 @@ typedef struct procinfo
   int alive;      /**< @brief Non-zero if process is alive, zero if process is zombie. */
 	
   unsigned long thread_count; /**< Current no of threads. */
+
+  unsigned long ptcb_count;   /**< @brief Current no of thread control blocks held by the process.
+
+              These are the threads that have not exited, plus the exited
+              threads that can still be joined. In the steady state it does
+              not grow with the number of threads created. */
 	
   Task main_task;  /**< @brief The main task of the process. */
 	
@@ -760,6 +875,100 @@ typedef struct procinfo
 Fid_t OpenInfo();
 
 
+/**
+  @brief The number of buckets in a run-queue wait histogram.
+
+  Bucket 0 counts waits shorter than 1 usec, and bucket @c b>0 counts 
+  waits of @c 2^(b-1) to @c 2^b-1 usec. The last bucket also counts all 
+  longer waits.
+  */
+#define SCHED_HIST_BUCKETS (20)
+
+/**
+	@brief Run-queue wait statistics for one core and one priority level.
+
+	The wait of a thread is the time from the moment it becomes ready
+	(or is preempted) to the moment it starts running.
+
+	This structure is returned by scheduler information streams.
+	@see OpenSchedInfo
+  */
+typedef struct schedinfo
+{
+	unsigned int core;     /**< @brief The core that ran the threads. */
+	sched_class sclass;    /**< @brief The scheduling class of the threads. */
+	int priority;          /**< @brief The real-time priority, or the scheduler 
+	                            level of a @c SCHED_CLASS_NORMAL thread. */
+
+	unsigned long count;      /**< @brief The number of waits. */
+	unsigned long total_usec; /**< @brief The sum of all waits, in usec. */
+	unsigned long max_usec;   /**< @brief The longest wait, in usec. */
+	unsigned long hist[SCHED_HIST_BUCKETS]; /**< @brief The log2-scale histogram of waits. */
+} schedinfo;
+
+
+/**
+	@brief Open a scheduler information stream.
+
+	This is a read-only stream that returns a sequence of 
+	@c schedinfo structures, each packed into a block of size 
+	@c sizeof(schedinfo), one for each pair of core and priority level
+	with a non-zero count of waits, by core and then by priority.
+
+	The statistics are accumulated since boot. As with @c OpenInfo,
+	there is no guarantee of timeliness.
+
+	@returns a file id on success, or NOFILE on error. Possible reasons
+		for error are:
+		- the available file ids for the process are exhausted.
+	@see OpenInfo
+ */
+Fid_t OpenSchedInfo();
+
+
+/**
+	@brief Stack depth statistics, for a live thread or for a task.
+
+	A record for a live thread has the thread's @c pid and @c tid. A
+	record for a task summarizes all the exited threads that executed
+	this task; its @c pid is @c NOPROC and its @c tid is @c NOTHREAD.
+
+	This structure is returned by stack information streams.
+	@see OpenStackInfo
+  */
+typedef struct stackinfo
+{
+	Task task;                /**< @brief The task of the thread(s). */
+	Pid_t pid;                /**< @brief The process of a live thread, or @c NOPROC. */
+	Tid_t tid;                /**< @brief The id of a live thread, or @c NOTHREAD. */
+	unsigned long threads;    /**< @brief The number of threads measured. */
+	unsigned long stack_size; /**< @brief The (largest) stack size, in bytes. */
+	unsigned long max_depth;  /**< @brief The maximum stack depth reached, in bytes. */
+} stackinfo;
+
+
+/**
+	@brief Open a stack information stream.
+
+	This is a read-only stream that returns a sequence of 
+	@c stackinfo structures, each packed into a block of size 
+	@c sizeof(stackinfo): first one for each live thread, and then one
+	for each task that was executed by exited threads, since boot. 
+
+	The stack depths are measured by painting the stacks of new threads,
+	which is enabled by setting the environment variable 
+	@c TINYOS_STACKPAINT before @c boot().
+	The contents of the stream are taken when it is opened.
+
+	@returns a file id on success, or NOFILE on error. Possible reasons
+		for error are:
+		- stack painting is not enabled.
+		- the available file ids for the process are exhausted.
+	@see OpenInfo
+ */
+Fid_t OpenStackInfo();
+
+
 
 
 /*******************************************
@@ -21,6 +21,8 @@ int Repeat(size_t,const char**);
 int Hanoi(size_t,const char**);
 int HelpMessage(size_t,const char**);
 int SystemInfo(size_t,const char**);
+int SchedInfo(size_t,const char**);
+int StackInfo(size_t,const char**);
 int Capitalize(size_t,const char**);
 int LowerCase(size_t,const char**);
 int LineEnum(size_t,const char**);
@@ -39,6 +41,8 @@ COMMANDS[]  =
 	{"help", HelpMessage, 0, "A help message."},
 	{"ls", ListPrograms, 0, "List available programs programs."},
 	{"sysinfo", SystemInfo, 0, "Print some basic info about the current system."},
+	{"schedinfo", SchedInfo, 0, "Print the run-queue wait histograms of the scheduler."},
+	{"stackinfo", StackInfo, 0, "Print the stack depths of threads (needs TINYOS_STACKPAINT)."},
 	{"runterm", RunTerm, 2, "runterm <term> <prog>  <args...> : execute '<prog> <args...>' on terminal <term>."},
 	{"sh", Shell, 0, "Run a shell."},
 	{"repeat", Repeat, 2, "repeat <n> <prog> <args...>: execute '<prog> <args...>' <n> times."},
@@ -172,8 +176,8 @@ int SystemInfo(size_t argc, const char** argv)
 	if(finfo!=NOFILE) {
 		/* Print per-process info */
 		procinfo info;
-		printf("%5s %5s %6s %8s %20s\n",
-			"PID", "PPID", "State", "Threads", "Main program"
+		printf("%5s %5s %6s %8s %8s %20s\n",
+			"PID", "PPID", "State", "Threads", "PTCBs", "Main program"
 			);
 		/* Read in next piece of info */		
 		while(Read(finfo, (char*) &info, sizeof(info)) > 0) {
@@ -189,11 +193,12 @@ int SystemInfo(size_t argc, const char** argv)
 				if(info.pid==1) pname = "init";
 			}
 
-			printf("%5d %5d %6s %8u %20s\n",
+			printf("%5d %5d %6s %8lu %8lu %20s\n",
 				info.pid,
 				info.ppid,
 				(info.alive?"ALIVE":"ZOMBIE"),
 				info.thread_count,
+				info.ptcb_count,
 				pname
 				);
 		}
@@ -203,6 +208,61 @@ int SystemInfo(size_t argc, const char** argv)
 }
 
 
+int SchedInfo(size_t argc, const char** argv)
+{
+	static const char* classname[] = { "NORMAL", "FIFO", "RR" };
+
+	Fid_t finfo = OpenSchedInfo();
+	if(finfo==NOFILE) {
+		printf("Cannot open the scheduler info stream\n");
+		return 1;
+	}
+
+	/* Print one line per core and level, with the non-empty buckets of
+	   the histogram as <limit>:<count>, where limit is in usec */
+	schedinfo info;
+	printf("%4s %6s %4s %8s %8s %8s  %s\n",
+		"Core", "Class", "Prio", "Waits", "Avg", "Max", "Histogram");
+	while(Read(finfo, (char*) &info, sizeof(info)) > 0) {
+		printf("%4u %6s %4d %8lu %8lu %8lu ",
+			info.core, classname[info.sclass], info.priority,
+			info.count, info.total_usec/info.count, info.max_usec);
+		for(int b=0; b<SCHED_HIST_BUCKETS; b++)
+			if(info.hist[b])
+				printf(" %s%lu:%lu", (b==SCHED_HIST_BUCKETS-1)?">=":"<", 
+					(b==SCHED_HIST_BUCKETS-1) ? (1ul<<(b-1)) : (1ul<<b), info.hist[b]);
+		printf("\n");
+	}
+	Close(finfo);
+	return 0;
+}
+
+
+int StackInfo(size_t argc, const char** argv)
+{
+	Fid_t finfo = OpenStackInfo();
+	if(finfo==NOFILE) {
+		printf("Cannot open the stack info stream (is TINYOS_STACKPAINT set?)\n");
+		return 1;
+	}
+
+	/* Print one line per live thread, and one per task of exited threads */
+	stackinfo info;
+	printf("%5s %18s %18s %8s %8s %8s\n",
+		"PID", "Thread", "Task", "Threads", "Size", "Depth");
+	while(Read(finfo, (char*) &info, sizeof(info)) > 0) {
+		if(info.tid != NOTHREAD)
+			printf("%5d %18lx", info.pid, (unsigned long) info.tid);
+		else
+			printf("%5s %18s", "-", "exited");
+		printf(" %18p %8lu %8lu %8lu\n",
+			(void*) info.task, info.threads, info.stack_size, info.max_depth);
+	}
+	Close(finfo);
+	return 0;
+}
+
+
 int HelpMessage(size_t argc, const char** argv)
 {
 	printf("This is a simple shell for tinyos.\n\
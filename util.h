@@ -582,6 +582,245 @@ static inline void rlist_select(rlnode* Lsrc, rlnode* Ldest, int (*pred)(rlnode*
 /* @} rlists */
 
 
+/*******************************************************
+ *
+ *
+ *******************************************************/
+
+/**
+	@defgroup avltrees  Ordered trees
+	@brief  A balanced (AVL) binary tree of nodes ordered by an integer key.
+
+	Like resource lists, trees are intrusive: an @c avlnode is embedded
+	in the object it orders, and it stores a pointer back to that object.
+	Insertion and removal take time O(log n). The node with the smallest 
+	key is cached in the tree, so that it is found in time O(1).
+
+	Nodes with equal keys are kept in insertion order, so that a tree 
+	can serve as a priority queue that is FIFO among equal keys.
+
+	For example,
+	@code
+	avltree T;
+	avltree_init(&T);
+	avlnode n;
+	avlnode_init(&n, obj)->key = 42;
+	avl_insert(&T, &n);
+	...
+	while(T.first != NULL) {
+		void* o = T.first->obj;
+		avl_remove(&T, T.first);
+		...
+	}
+	@endcode
+
+	@{
+ */
+
+/** @brief A convenience typedef */
+typedef struct avl_tree_node avlnode;
+
+/**
+	@brief Tree node
+*/
+struct avl_tree_node {
+	/** @brief The node's object, as in @c rlnode */
+	union {
+		TCB* tcb;
+		void* obj;
+	};
+	uint64_t key;		/**< @brief The ordering key */
+
+	avlnode* left;		/**< @brief Left subtree (smaller keys) */
+	avlnode* right;		/**< @brief Right subtree (equal or larger keys) */
+	avlnode* parent;	/**< @brief Parent node, or NULL for the root */
+	int height;			/**< @brief Height of the subtree rooted at this node */
+};
+
+/**
+	@brief A tree
+*/
+typedef struct avl_tree {
+	avlnode* root;		/**< @brief The root node, or NULL for an empty tree */
+	avlnode* first;		/**< @brief The node with the smallest key, or NULL for an empty tree */
+	size_t size;		/**< @brief The number of nodes in the tree */
+} avltree;
+
+/** @brief Initialize an empty tree. */
+static inline void avltree_init(avltree* t) 
+{ 
+	t->root = t->first = NULL; 
+	t->size = 0; 
+}
+
+/**
+	@brief Initialize a tree node.
+
+	@param n the node to initialize
+	@param ptr the object of the node
+	@returns the node itself
+*/
+static inline avlnode* avlnode_init(avlnode* n, void* ptr)
+{
+	n->obj = ptr;
+	n->key = 0;
+	n->left = n->right = n->parent = NULL;
+	n->height = 1;
+	return n;
+}
+
+/** @brief The height of a (possibly empty) subtree */
+static inline int avl_height(avlnode* n) { return n ? n->height : 0; }
+
+/** @brief Recompute the height of a node from its children */
+static inline void avl_update(avlnode* n)
+{
+	int hl = avl_height(n->left), hr = avl_height(n->right);
+	n->height = 1 + (hl > hr ? hl : hr);
+}
+
+/** @brief Make @c nnew take the place of @c old, as a child of @c parent */
+static inline void avl_replace_child(avltree* t, avlnode* parent, avlnode* old, avlnode* nnew)
+{
+	if(parent == NULL) t->root = nnew;
+	else if(parent->left == old) parent->left = nnew;
+	else parent->right = nnew;
+	if(nnew) nnew->parent = parent;
+}
+
+/** @brief Rotate the subtree at @c x to the left, returning its new root */
+static inline avlnode* avl_rotate_left(avltree* t, avlnode* x)
+{
+	avlnode* y = x->right;
+	x->right = y->left;
+	if(y->left) y->left->parent = x;
+	avl_replace_child(t, x->parent, x, y);
+	y->left = x;
+	x->parent = y;
+	avl_update(x);
+	avl_update(y);
+	return y;
+}
+
+/** @brief Rotate the subtree at @c x to the right, returning its new root */
+static inline avlnode* avl_rotate_right(avltree* t, avlnode* x)
+{
+	avlnode* y = x->left;
+	x->left = y->right;
+	if(y->right) y->right->parent = x;
+	avl_replace_child(t, x->parent, x, y);
+	y->right = x;
+	x->parent = y;
+	avl_update(x);
+	avl_update(y);
+	return y;
+}
+
+/** @brief Restore heights and balance on the path from @c n to the root */
+static inline void avl_rebalance(avltree* t, avlnode* n)
+{
+	while(n != NULL) {
+		avl_update(n);
+		int balance = avl_height(n->left) - avl_height(n->right);
+		if(balance > 1) {
+			if(avl_height(n->left->left) < avl_height(n->left->right))
+				avl_rotate_left(t, n->left);
+			n = avl_rotate_right(t, n);
+		} else if(balance < -1) {
+			if(avl_height(n->right->right) < avl_height(n->right->left))
+				avl_rotate_right(t, n->right);
+			n = avl_rotate_left(t, n);
+		}
+		n = n->parent;
+	}
+}
+
+/**
+	@brief Return the node following @c n in key order, or NULL.
+*/
+static inline avlnode* avl_next(avlnode* n)
+{
+	if(n->right) {
+		for(n = n->right; n->left; n = n->left);
+		return n;
+	}
+	while(n->parent && n == n->parent->right) n = n->parent;
+	return n->parent;
+}
+
+/**
+	@brief Insert a node into a tree, according to its @c key.
+
+	The node is placed after all nodes of equal key.
+	@param t the tree
+	@param n the node, which must not be in any tree
+*/
+static inline void avl_insert(avltree* t, avlnode* n)
+{
+	avlnode* p = NULL;
+	avlnode** link = &t->root;
+	int leftmost = 1;
+
+	while(*link) {
+		p = *link;
+		if(n->key < p->key) 
+			link = &p->left;
+		else {
+			link = &p->right;
+			leftmost = 0;
+		}
+	}
+
+	n->left = n->right = NULL;
+	n->height = 1;
+	n->parent = p;
+	*link = n;
+	if(leftmost) t->first = n;
+	t->size++;
+
+	avl_rebalance(t, p);
+}
+
+/**
+	@brief Remove a node from a tree.
+
+	@param t the tree
+	@param n a node in @c t
+*/
+static inline void avl_remove(avltree* t, avlnode* n)
+{
+	if(t->first == n) t->first = avl_next(n);
+
+	avlnode* from;	/* the lowest node whose subtree changed */
+	if(n->left && n->right) {
+		/* Put the successor of n in its place */
+		avlnode* s;
+		for(s = n->right; s->left; s = s->left);
+		if(s->parent != n) {
+			from = s->parent;
+			avl_replace_child(t, s->parent, s, s->right);
+			s->right = n->right;
+			s->right->parent = s;
+		} else
+			from = s;
+		avl_replace_child(t, n->parent, n, s);
+		s->left = n->left;
+		s->left->parent = s;
+		s->height = n->height;
+	} else {
+		from = n->parent;
+		avl_replace_child(t, n->parent, n, n->left ? n->left : n->right);
+	}
+
+	n->left = n->right = n->parent = NULL;
+	t->size--;
+
+	avl_rebalance(t, from);
+}
+
+/* @} avltrees */
+
+
 
 /*
 	Some helpers for packing and unpacking vectors of strings into
@@ -509,6 +509,109 @@ BOOT_TEST(test_cond_timedwait_broadcast,
 }
 
 
+struct broadcast_args {
+	Mutex m;
+	CondVar cv, pcv;
+	int waiting, go, signalled;
+};
+
+static int broadcast_waiter(int argl, void* args)
+{
+	struct broadcast_args* A = args;
+	Mutex_Lock(&A->m);
+	A->waiting++;
+	Cond_Signal(&A->pcv);
+	while(! A->go)
+		if(Cond_Wait(&A->m, &A->cv)) A->signalled++;
+	Mutex_Unlock(&A->m);
+	return 0;
+}
+
+BOOT_TEST(test_cond_broadcast_many,
+	"Test that a broadcast signals every waiter on a condition variable, in any number of batches."
+	)
+{
+	struct broadcast_args A = { .m=MUTEX_INIT, .cv=COND_INIT, .pcv=COND_INIT };
+	const int N=200;
+	Tid_t tids[N];
+
+	for(int i=0; i<N; i++) tids[i] = CreateThread(broadcast_waiter, 0, &A);
+
+	Mutex_Lock(&A.m);
+	while(A.waiting!=N) Cond_Wait(&A.m, &A.pcv);
+	A.go = 1;
+	Cond_Broadcast(&A.cv);
+	Mutex_Unlock(&A.m);
+
+	for(int i=0; i<N; i++) ASSERT(ThreadJoin(tids[i], NULL)==0);
+	ASSERT(A.signalled == N);
+	return 0;
+}
+
+
+/* A one-slot buffer, passed back and forth with Cond_SignalHandoff */
+struct handoff_args {
+	Mutex m;
+	CondVar full, empty;
+	int slot;	/* 0 if empty */
+	int sum;
+	int consumed;	/* Items consumed before their Cond_SignalHandoff returned */
+};
+
+static int handoff_consumer(int argl, void* args)
+{
+	struct handoff_args* A = args;
+	for(int i=1; i<=argl; i++) {
+		Mutex_Lock(&A->m);
+		while(A->slot==0) Cond_Wait(&A->m, &A->full);
+		ASSERT(A->slot == i);
+		A->sum += A->slot;
+		A->slot = 0;
+		Mutex_Unlock(&A->m);
+		Cond_SignalHandoff(&A->empty);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_cond_signal_handoff,
+	"Test that a producer and a consumer can pass items with Cond_SignalHandoff."
+	)
+{
+	struct handoff_args A = { .m=MUTEX_INIT, .full=COND_INIT, .empty=COND_INIT };
+	const int N=2000, M=100;
+
+	/* Signalling nobody is a no-op */
+	Cond_SignalHandoff(&A.full);
+
+	/* Nobody signals this, it is only used to sleep */
+	CondVar sleep_cv = COND_INIT;
+
+	Tid_t t = CreateThread(handoff_consumer, N+M, &A);
+	for(int i=1; i<=N+M; i++) {
+		Mutex_Lock(&A.m);
+		while(A.slot!=0) Cond_Wait(&A.m, &A.empty);
+		/* For the last M items, let the consumer wait for the item first */
+		if(i>N) Cond_TimedWait(&A.m, &sleep_cv, 1);
+		A.slot = i;
+		Mutex_Unlock(&A.m);
+		Cond_SignalHandoff(&A.full);
+
+		Mutex_Lock(&A.m);
+		if(i>N && A.slot==0) A.consumed++;
+		Mutex_Unlock(&A.m);
+	}
+
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(A.sum == (N+M)*(N+M+1)/2);
+
+	/* On one core, a waiting consumer runs on our core as soon as it is 
+	   signalled (except when preempted first); with Cond_Signal it would not */
+	if(cpu_cores()==1)
+		ASSERT(A.consumed >= M*9/10);
+	return 0;
+}
+
+
 
 /*********************************************
  *
@@ -920,6 +1023,8 @@ TEST_SUITE(basic_tests,
 	&test_cond_timedwait_timeout,
 	&test_cond_timedwait_signal,
 	&test_cond_timedwait_broadcast,
+	&test_cond_broadcast_many,
+	&test_cond_signal_handoff,
 	&test_null_device,
 	&test_get_terminals,
 	&test_open_terminals,
@@ -1026,6 +1131,30 @@ BOOT_TEST(test_detach_illegal_tid_gives_error,
 }
 
 
+static int stale_tid_task(int argl, void* args) { return argl; }
+
+BOOT_TEST(test_stale_tid_gives_error,
+	"Test that the Tid of a joined thread is not reused for a new thread")
+{
+	Tid_t t1 = CreateThread(stale_tid_task, 1, NULL);
+	ASSERT(t1!=NOTHREAD);
+	ASSERT(ThreadJoin(t1, NULL)==0);
+
+	/* The new thread may take over the resources of the old one */
+	Tid_t t2 = CreateThread(stale_tid_task, 2, NULL);
+	ASSERT(t2!=NOTHREAD && t2!=t1);
+
+	ASSERT(ThreadJoin(t1, NULL)==-1);
+	ASSERT(ThreadDetach(t1)==-1);
+	ASSERT(SetSchedParam(t1, SCHED_CLASS_NORMAL, 0)==-1);
+
+	int exitval;
+	ASSERT(ThreadJoin(t2, &exitval)==0);
+	ASSERT(exitval==2);
+	return 0;
+}
+
+
 
 static int create_join_thread_flag;
 
@@ -1398,12 +1527,465 @@ BOOT_TEST(test_cyclic_joins,
 }
 
 
+BOOT_TEST(test_sched_param_illegal,
+	"Test that SetSchedParam and GetSchedParam reject illegal arguments")
+{
+	Tid_t self = ThreadSelf();
+	sched_class sclass;
+	int prio;
+
+	ASSERT(SetSchedParam(NOTHREAD, SCHED_CLASS_FIFO, 0)==-1);
+	ASSERT(GetSchedParam(NOTHREAD, &sclass, &prio)==-1);
+	for(int i=0; i<100; i++) {
+		Tid_t random_tid = lrand48();
+		if(random_tid==self) continue;
+		ASSERT(SetSchedParam(random_tid, SCHED_CLASS_RR, 0)==-1);
+		ASSERT(GetSchedParam(random_tid, &sclass, &prio)==-1);
+	}
+
+	ASSERT(SetSchedParam(self, SCHED_CLASS_FIFO, -1)==-1);
+	ASSERT(SetSchedParam(self, SCHED_CLASS_RR, MAX_RT_PRIORITY+1)==-1);
+	ASSERT(SetSchedParam(self, SCHED_CLASS_NORMAL, 1)==-1);
+	ASSERT(SetSchedParam(self, (sched_class) 17, 0)==-1);
+
+	/* Nothing has changed */
+	ASSERT(GetSchedParam(self, &sclass, &prio)==0);
+	ASSERT(sclass==SCHED_CLASS_NORMAL && prio==0);
+	return 0;
+}
+
+
+static int sched_param_task(int argl, void* args)
+{
+	sched_class sclass;
+	int prio;
+	ASSERT(GetSchedParam(ThreadSelf(), &sclass, &prio)==0);
+	ASSERT(sclass==SCHED_CLASS_RR && prio==7);
+	return 0;
+}
+
+BOOT_TEST(test_sched_param_set_get,
+	"Test that the scheduling parameters set by SetSchedParam are returned by GetSchedParam")
+{
+	Tid_t self = ThreadSelf();
+	sched_class sclass;
+	int prio;
+
+	ASSERT(SetSchedParam(self, SCHED_CLASS_FIFO, MAX_RT_PRIORITY)==0);
+	ASSERT(GetSchedParam(self, &sclass, &prio)==0);
+	ASSERT(sclass==SCHED_CLASS_FIFO && prio==MAX_RT_PRIORITY);
+
+	/* Set the parameters of another thread */
+	Tid_t t = CreateThread(sched_param_task, 0, NULL);
+	ASSERT(SetSchedParam(t, SCHED_CLASS_RR, 7)==0);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* Return to normal */
+	ASSERT(SetSchedParam(self, SCHED_CLASS_NORMAL, 0)==0);
+	ASSERT(GetSchedParam(self, NULL, &prio)==0);
+	ASSERT(prio==0);
+	return 0;
+}
+
+
+static int sched_demote_reader(int argl, void* args)
+{
+	char buf[4];
+	ASSERT(Read(argl, buf, sizeof(buf))==sizeof(buf));
+	*(int*)args = 1;
+	return 0;
+}
+
+BOOT_TEST(test_sched_param_demote_self,
+	"Test that a real-time thread can lower its priority while a real-time thread of its process does a Read"
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	ASSERT(Write(pipe.write, "abcd", 4)==4);
+
+	Tid_t self = ThreadSelf();
+	ASSERT(SetSchedParam(self, SCHED_CLASS_FIFO, 2)==0);
+
+	/* The reader will outrank us as soon as we are demoted */
+	int done = 0;
+	thread_attr attr = THREAD_ATTR_INIT;
+	attr.sclass = SCHED_CLASS_FIFO;
+	attr.priority = 1;
+	Tid_t t = CreateThreadAttr(sched_demote_reader, pipe.read, &done, &attr);
+	ASSERT(t!=NOTHREAD);
+
+	ASSERT(SetSchedParam(self, SCHED_CLASS_NORMAL, 0)==0);
+	if(cpu_cores()==1) ASSERT(done);
+
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(done);
+	ASSERT(Close(pipe.read)==0);
+	ASSERT(Close(pipe.write)==0);
+	return 0;
+}
+
+
+static unsigned int rt_finished;
+
+static int rt_compute_task(int argl, void* args)
+{
+	fibo(30);
+	*(unsigned int*)args = __atomic_fetch_add(&rt_finished, 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+BOOT_TEST(test_rt_thread_runs_ahead,
+	"Test that a real-time thread runs ahead of compute-bound normal threads"
+	)
+{
+	enum { N = 8 };
+	unsigned int order[N+1];
+	Tid_t tids[N+1];
+
+	rt_finished = 0;
+	for(int i=0; i<N; i++)
+		tids[i] = CreateThread(rt_compute_task, 0, &order[i]);
+	tids[N] = CreateThread(rt_compute_task, 0, &order[N]);
+	ASSERT(SetSchedParam(tids[N], SCHED_CLASS_FIFO, 1)==0);
+
+	for(int i=0; i<=N; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	/* The real-time thread must not finish last */
+	ASSERT(order[N] < N);
+	return 0;
+}
+
+
+static int sched_info_task(int argl, void* args) { return 0; }
+
+BOOT_TEST(test_open_sched_info,
+	"Test that the scheduler information stream reports the run-queue waits of threads"
+	)
+{
+	Tid_t t = CreateThread(sched_info_task, 0, NULL);
+	ASSERT(SetSchedParam(t, SCHED_CLASS_RR, 3)==0);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	Fid_t finfo = OpenSchedInfo();
+	ASSERT(finfo!=NOFILE);
+
+	/* A short buffer is an error */
+	char small[sizeof(schedinfo)-1];
+	ASSERT(Read(finfo, small, sizeof(small))==-1);
+
+	schedinfo info;
+	int found = 0;
+	unsigned long waits = 0;
+	unsigned int last_core = 0;
+	while(Read(finfo, (char*) &info, sizeof(info)) == sizeof(info)) {
+		ASSERT(info.core < cpu_cores() && info.core >= last_core);
+		ASSERT(info.count > 0);
+		ASSERT(info.max_usec <= info.total_usec);
+		last_core = info.core;
+		waits += info.count;
+		if(info.sclass==SCHED_CLASS_RR && info.priority==3)
+			found = 1;
+	}
+	ASSERT(found);
+	ASSERT(waits > 0);
+
+	ASSERT(Close(finfo)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_many_idle_threads,
+	"Test that many mostly idle threads can exist at once"
+	)
+{
+	struct broadcast_args* A = malloc(sizeof(struct broadcast_args));
+	*A = (struct broadcast_args){ .m=MUTEX_INIT, .cv=COND_INIT, .pcv=COND_INIT };
+	const int N=10000;
+	Tid_t* tids = malloc(N*sizeof(Tid_t));
+
+	for(int i=0; i<N; i++) {
+		tids[i] = CreateThread(broadcast_waiter, 0, A);
+		ASSERT(tids[i]!=NOTHREAD);
+	}
+
+	Mutex_Lock(&A->m);
+	while(A->waiting!=N) Cond_Wait(&A->m, &A->pcv);
+	A->go = 1;
+	Cond_Broadcast(&A->cv);
+	Mutex_Unlock(&A->m);
+
+	for(int i=0; i<N; i++) ASSERT(ThreadJoin(tids[i], NULL)==0);
+	ASSERT(A->signalled == N);
+
+	free(tids);
+	free(A);
+	return 0;
+}
+
+
+
+static unsigned long msec_now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return tspec2msec(t);
+}
+
+static int spin_task(int argl, void* args)
+{
+	while(! __atomic_load_n((int*)args, __ATOMIC_RELAXED));
+	return 0;
+}
+
+BOOT_TEST(test_lone_thread_keeps_running,
+	"Test that a thread which ran alone for a while is not starved by new competitors"
+	)
+{
+	int stop = 0;
+
+	/* Run alone */
+	unsigned long t0 = msec_now();
+	while(msec_now() - t0 < 500);
+
+	Tid_t t1 = CreateThread(spin_task, 0, &stop);
+	Tid_t t2 = CreateThread(spin_task, 0, &stop);
+	ASSERT(t1!=NOTHREAD && t2!=NOTHREAD);
+
+	/* Measure the longest time we were kept off the core */
+	unsigned long maxgap = 0;
+	unsigned long last = t0 = msec_now();
+	while(last - t0 < 300) {
+		unsigned long now = msec_now();
+		if(now - last > maxgap) maxgap = now - last;
+		last = now;
+	}
+
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	ASSERT(ThreadJoin(t1, NULL)==0);
+	ASSERT(ThreadJoin(t2, NULL)==0);
+
+	ASSERT(maxgap < 200);
+	return 0;
+}
+
+
+
+BOOT_TEST(test_create_thread_attr_illegal,
+	"Test that CreateThreadAttr rejects illegal attributes"
+	)
+{
+	thread_attr attr = THREAD_ATTR_INIT;
+	ASSERT(CreateThreadAttr(NULL, 0, NULL, &attr)==NOTHREAD);
+
+	attr.sclass = 3;
+	ASSERT(CreateThreadAttr(sched_info_task, 0, NULL, &attr)==NOTHREAD);
+
+	attr = THREAD_ATTR_INIT;
+	attr.priority = MAX_NORMAL_PRIORITY+1;
+	ASSERT(CreateThreadAttr(sched_info_task, 0, NULL, &attr)==NOTHREAD);
+	attr.priority = -1;
+	ASSERT(CreateThreadAttr(sched_info_task, 0, NULL, &attr)==NOTHREAD);
+
+	attr = THREAD_ATTR_INIT;
+	attr.sclass = SCHED_CLASS_FIFO;
+	attr.priority = MAX_RT_PRIORITY+1;
+	ASSERT(CreateThreadAttr(sched_info_task, 0, NULL, &attr)==NOTHREAD);
+
+	attr = THREAD_ATTR_INIT;
+	attr.stack_size = (size_t)1 << 40;
+	ASSERT(CreateThreadAttr(sched_info_task, 0, NULL, &attr)==NOTHREAD);
+	return 0;
+}
+
+
+static int attr_rt_task(int argl, void* args)
+{
+	sched_class sclass;
+	int prio;
+	ASSERT(GetSchedParam(ThreadSelf(), &sclass, &prio)==0);
+	ASSERT(sclass==SCHED_CLASS_RR && prio==argl);
+	return 0;
+}
+
+BOOT_TEST(test_create_thread_attr,
+	"Test that the attributes of CreateThreadAttr take effect"
+	)
+{
+	/* NULL attributes are the defaults */
+	Tid_t t = CreateThreadAttr(sched_info_task, 0, NULL, NULL);
+	ASSERT(t!=NOTHREAD);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* A real-time thread with a large stack */
+	thread_attr attr = THREAD_ATTR_INIT;
+	attr.sclass = SCHED_CLASS_RR;
+	attr.priority = 5;
+	attr.stack_size = 1<<20;
+	t = CreateThreadAttr(attr_rt_task, 5, NULL, &attr);
+	ASSERT(t!=NOTHREAD);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* A detached thread cannot be joined */
+	attr = THREAD_ATTR_INIT;
+	attr.detached = 1;
+	attr.priority = MAX_NORMAL_PRIORITY;
+	t = CreateThreadAttr(sched_info_task, 0, NULL, &attr);
+	ASSERT(t!=NOTHREAD);
+	ASSERT(ThreadJoin(t, NULL)==-1);
+	return 0;
+}
+
+
+static int small_stack_task(int argl, void* args)
+{
+	char buf[4096];
+	memset(buf, argl, sizeof(buf));
+	Mutex_Lock(&((struct broadcast_args*)args)->m);
+	((struct broadcast_args*)args)->signalled += buf[argl % sizeof(buf)] == (char)argl;
+	Cond_Signal(&((struct broadcast_args*)args)->pcv);
+	Mutex_Unlock(&((struct broadcast_args*)args)->m);
+	return 0;
+}
+
+BOOT_TEST(test_many_small_detached_threads,
+	"Test that many detached threads with small stacks can be created"
+	)
+{
+	struct broadcast_args* A = malloc(sizeof(struct broadcast_args));
+	*A = (struct broadcast_args){ .m=MUTEX_INIT, .cv=COND_INIT, .pcv=COND_INIT };
+	const int N=2000;
+
+	thread_attr attr = THREAD_ATTR_INIT;
+	attr.stack_size = 8192;
+	attr.detached = 1;
+	for(int i=0; i<N; i++)
+		ASSERT(CreateThreadAttr(small_stack_task, i, A, &attr)!=NOTHREAD);
+
+	Mutex_Lock(&A->m);
+	while(A->signalled!=N) Cond_Wait(&A->m, &A->pcv);
+	Mutex_Unlock(&A->m);
+
+	free(A);
+	return 0;
+}
+
+
+
+/* Return the ptcb_count of the current process, from OpenInfo */
+static unsigned long my_ptcb_count()
+{
+	Fid_t finfo = OpenInfo();
+	ASSERT(finfo!=NOFILE);
+	procinfo info;
+	unsigned long count = (unsigned long)-1;
+	while(Read(finfo, (char*) &info, sizeof(info)) == sizeof(info))
+		if(info.pid == GetPid()) count = info.ptcb_count;
+	ASSERT(Close(finfo)==0);
+	return count;
+}
+
+static int reclaim_task(int argl, void* args) { return argl; }
+
+BOOT_TEST(test_detached_ptcbs_reclaimed,
+	"Test that the PTCBs of detached threads and joined threads are reclaimed"
+	)
+{
+	const int N = 1000;
+	ASSERT(my_ptcb_count()==1);
+
+	thread_attr attr = THREAD_ATTR_INIT;
+	attr.detached = 1;
+	for(int i=0; i<N; i++) {
+		ASSERT(CreateThreadAttr(reclaim_task, i, NULL, &attr)!=NOTHREAD);
+		Tid_t t = CreateThread(reclaim_task, i, NULL);
+		ASSERT(t!=NOTHREAD);
+		if(i % 2)
+			ASSERT(ThreadDetach(t)==0 || ThreadJoin(t, NULL)==0);
+		else
+			ASSERT(ThreadJoin(t, NULL)==0);
+	}
+
+	/* Wait for the detached threads to exit */
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	for(int i=0; i<1000 && my_ptcb_count()>1; i++) {
+		Mutex_Lock(&mx);
+		Cond_TimedWait(&mx, &cv, 10);
+		Mutex_Unlock(&mx);
+	}
+	ASSERT(my_ptcb_count()==1);
+	return 0;
+}
+
+
+
+static int deep_stack_task(int argl, void* args)
+{
+	volatile char buf[32*1024];
+	buf[0] = 1;
+	return buf[0];
+}
+
+struct stack_test_rec {
+	int opened;
+	int live_self;          /* A record for the main thread was found */
+	unsigned long depth;    /* The max depth of deep_stack_task */
+	unsigned long size;     /* The stack size of deep_stack_task */
+	unsigned long threads;  /* The number of deep_stack_task threads */
+};
+
+static int stack_info_boot(int argl, void* args)
+{
+	struct stack_test_rec* R = *(struct stack_test_rec**) args;
+
+	for(int i=0; i<3; i++) {
+		Tid_t t = CreateThread(deep_stack_task, 0, NULL);
+		ThreadJoin(t, NULL);
+	}
+
+	Fid_t finfo = OpenStackInfo();
+	R->opened = (finfo != NOFILE);
+	stackinfo info;
+	while(Read(finfo, (char*) &info, sizeof(info)) == sizeof(info)) {
+		if(info.tid == ThreadSelf() && info.pid == GetPid())
+			R->live_self = 1;
+		if(info.task == deep_stack_task && info.tid == NOTHREAD) {
+			R->depth = info.max_depth;
+			R->size = info.stack_size;
+			R->threads = info.threads;
+		}
+	}
+	Close(finfo);
+	return 0;
+}
+
+BARE_TEST(test_stack_info,
+	"Test that the stack information stream reports the depth reached by the stacks of threads")
+{
+	struct stack_test_rec rec = { 0 };
+	struct stack_test_rec* recp = &rec;
+
+	setenv("TINYOS_STACKPAINT", "1", 1);
+	boot(1, 0, stack_info_boot, sizeof(recp), &recp);
+	unsetenv("TINYOS_STACKPAINT");
+
+	ASSERT(rec.opened);
+	ASSERT(rec.live_self);
+	ASSERT(rec.threads == 3);
+	ASSERT(rec.depth >= 32*1024 && rec.depth <= rec.size);
+}
+
+
+
 TEST_SUITE(thread_tests, 
 	"A suite of tests for threads."
 	)
 {
 	&test_join_illegal_tid_gives_error,
 	&test_detach_illegal_tid_gives_error,
+	&test_stale_tid_gives_error,
 	&test_detach_self,
 	&test_detach_other,
 	&test_multiple_detach,
@@ -1416,6 +1998,18 @@ TEST_SUITE(thread_tests,
 	&test_main_exit_cleanup,
 	&test_noexit_cleanup,
 	&test_cyclic_joins,
+	&test_sched_param_illegal,
+	&test_sched_param_set_get,
+	&test_sched_param_demote_self,
+	&test_rt_thread_runs_ahead,
+	&test_open_sched_info,
+	&test_many_idle_threads,
+	&test_lone_thread_keeps_running,
+	&test_create_thread_attr_illegal,
+	&test_create_thread_attr,
+	&test_many_small_detached_threads,
+	&test_detached_ptcbs_reclaimed,
+	&test_stack_info,
 	NULL
 };
 
@@ -1633,6 +2227,108 @@ BOOT_TEST(test_pipe_multi_producer,
 }
 
 
+static int pipe_checker(int argl, void* args)
+{
+	Fid_t rfid = *(Fid_t*)args;
+	char buffer[1000];
+	unsigned char next = 0;
+	int count = 0, rc;
+
+	while((rc = Read(rfid, buffer, sizeof(buffer))) > 0) {
+		for(int i=0; i<rc; i++, next++)
+			ASSERT((unsigned char)buffer[i] == next);
+		count += rc;
+	}
+	return count;
+}
+
+static int pipe_loopback(int argl, void* args)
+{
+	int N = *(int*)args;
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	Tid_t t = CreateThread(pipe_checker, sizeof(Fid_t), &pipe.read);
+	ASSERT(t != NOTHREAD);
+
+	char buffer[777];
+	unsigned char next = 0;
+	for(int sent = 0; sent < N; ) {
+		int n = (N - sent < sizeof(buffer)) ? N - sent : sizeof(buffer);
+		for(int i=0; i<n; i++) buffer[i] = next++;
+		ASSERT(Write(pipe.write, buffer, n) == n);
+		sent += n;
+	}
+	Close(pipe.write);
+
+	int count;
+	ASSERT(ThreadJoin(t, &count) == 0);
+	ASSERT(count == N);
+	return 0;
+}
+
+static int pipe_pong_reader(int argl, void* args)
+{
+	char c;
+	while(Read(argl, &c, 1)==1)
+		__atomic_add_fetch((int*)args, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+BOOT_TEST(test_pipe_write_hands_off,
+	"Test that a Write to a pipe with a waiting reader runs the reader at once, on one core."
+	)
+{
+	const int N=100;
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	int received = 0, early = 0;
+	Tid_t t = CreateThread(pipe_pong_reader, pipe.read, &received);
+	ASSERT(t != NOTHREAD);
+
+	/* Nobody signals this, it is only used to sleep */
+	Mutex m = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	for(int i=1; i<=N; i++) {
+		/* Let the reader block on the empty pipe */
+		Mutex_Lock(&m);
+		Cond_TimedWait(&m, &cv, 1);
+		Mutex_Unlock(&m);
+
+		ASSERT(Write(pipe.write, "x", 1)==1);
+		if(__atomic_load_n(&received, __ATOMIC_ACQUIRE)==i) early++;
+	}
+	ASSERT(Close(pipe.write)==0);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(received==N);
+	ASSERT(Close(pipe.read)==0);
+
+	/* On one core, the reader got each byte before Write returned (except
+	   when preempted), since the writer handed it the core */
+	if(cpu_cores()==1)
+		ASSERT(early >= N*9/10);
+	return 0;
+}
+
+BOOT_TEST(test_pipes_in_parallel_processes,
+	"Test that many processes, each with a pipe of its own between two threads, run in parallel correctly."
+	)
+{
+	int N = 200000;
+	for(int i=0; i<8; i++)
+		ASSERT(Exec(pipe_loopback, sizeof(N), &N)!=NOPROC);
+
+	int status;
+	for(int i=0; i<8; i++) {
+		ASSERT(WaitChild(NOPROC, &status) != NOPROC);
+		ASSERT(status == 0);
+	}
+	return 0;
+}
+
+
 TEST_SUITE(pipe_tests,
 	"A suite of tests for pipes. We are focusing on correctness, not performance."
 	)
@@ -1643,6 +2339,8 @@ TEST_SUITE(pipe_tests,
 	&test_pipe_close_writer,
 	&test_pipe_single_producer,
 	&test_pipe_multi_producer,
+	&test_pipes_in_parallel_processes,
+	&test_pipe_write_hands_off,
 	NULL
 };
 